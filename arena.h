@@ -0,0 +1,160 @@
+#ifdef MM_IMPLEMENT
+	#ifndef ARENA_H_IMPLEMENTED
+		#define ARENA_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef ARENA_H
+		#define ARENA_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "arena.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "fast_fail.h"
+
+//A bump allocator. Allocating is (almost always) just moving a pointer
+//forward, and there's no way to free one thing: arena_free throws away
+//everything at once. Great for piles of little objects that all die at
+//the same time, like the keys of a map that only lives for one request.
+//
+//Same chunk idea as skiplist.h's tower pool: memory comes from malloc in
+//big chunks, each of which starts with a pointer to the previous chunk so
+//that arena_free can walk them all.
+//
+//  arena a;
+//  arena_init(&a);
+//  char *s = arena_strdup(&a, "hello");
+//  struct foo *f = arena_alloc(&a, sizeof(struct foo));
+//  ...
+//  arena_free(&a); //s and f are both gone now
+
+#ifndef MM_IMPLEMENT
+typedef struct {
+    void *chunks; //Most recent chunk. Each one points to the one before
+    char *bump;
+    size_t left; //Bytes left after bump in the current chunk
+    size_t next_chunk_sz;
+} arena;
+
+#define ARENA_INIT {NULL, NULL, 0, ARENA_MIN_CHUNK}
+
+//Chunks start out at ARENA_MIN_CHUNK bytes and double every time, up to
+//ARENA_MAX_CHUNK. Anything too big for a chunk gets one to itself.
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_MAX_CHUNK (1 << 20)
+
+//Everything arena_alloc returns is aligned to this
+#define ARENA_ALIGN 16
+#endif
+
+void arena_init(arena *a)
+#ifdef MM_IMPLEMENT
+{
+    a->chunks = NULL;
+    a->bump = NULL;
+    a->left = 0;
+    a->next_chunk_sz = ARENA_MIN_CHUNK;
+}
+#else
+;
+#endif
+
+#ifdef MM_IMPLEMENT
+//The header of each chunk is padded out so that the memory after it is
+//aligned
+#define __ARENA_HDR_SZ ((sizeof(void*) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static void *arena_new_chunk(arena *a, size_t sz) {
+    void **chunk = malloc(__ARENA_HDR_SZ + sz);
+    if (!chunk) FAST_FAIL("out of memory");
+    chunk[0] = a->chunks;
+    a->chunks = chunk;
+    return ((char *) chunk) + __ARENA_HDR_SZ;
+}
+#endif
+
+void *arena_alloc(arena *a, size_t sz)
+#ifdef MM_IMPLEMENT
+{
+    //Zero byte allocations still get their own (non-NULL) pointer
+    if (sz == 0) sz = 1;
+    sz = (sz + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (sz > a->left) {
+        //Big allocations get their own chunk. This way they don't waste
+        //the rest of the current chunk.
+        if (sz > ARENA_MAX_CHUNK / 4) return arena_new_chunk(a, sz);
+
+        size_t chunk_sz = a->next_chunk_sz;
+        while (chunk_sz < sz) chunk_sz *= 2;
+        if (chunk_sz < ARENA_MAX_CHUNK) a->next_chunk_sz = chunk_sz * 2;
+
+        a->bump = arena_new_chunk(a, chunk_sz);
+        a->left = chunk_sz;
+    }
+
+    void *ret = a->bump;
+    a->bump += sz;
+    a->left -= sz;
+    return ret;
+}
+#else
+;
+#endif
+
+void *arena_memdup(arena *a, void const *p, size_t sz)
+#ifdef MM_IMPLEMENT
+{
+    void *ret = arena_alloc(a, sz);
+    memcpy(ret, p, sz);
+    return ret;
+}
+#else
+;
+#endif
+
+char *arena_strdup(arena *a, char const *s)
+#ifdef MM_IMPLEMENT
+{
+    return arena_memdup(a, s, strlen(s) + 1);
+}
+#else
+;
+#endif
+
+//Frees everything that was ever allocated from a. a is left empty and can
+//be used again.
+void arena_free(arena *a)
+#ifdef MM_IMPLEMENT
+{
+    void **chunk = a->chunks;
+    while (chunk) {
+        void **next = chunk[0];
+        free(chunk);
+        chunk = next;
+    }
+    arena_init(a);
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,372 @@
+#ifdef MM_IMPLEMENT
+	#ifndef COMPACT_MAP_H_IMPLEMENTED
+		#define COMPACT_MAP_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef COMPACT_MAP_H
+		#define COMPACT_MAP_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "compact_map.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "map.h" //For the hash/comp/free functions and the VAL2VAL etc. helpers
+#include "fast_fail.h"
+
+//A chained hash map like map.h, but with the entries taken apart so that
+//small maps stay small. In map.h, every entry carries a 16 byte list_head,
+//the flags word and the cached hash, so a uint32_t -> uint32_t map spends
+//32 bytes on 8 bytes of payload. Here, each part of an entry lives in its
+//own array:
+//  - keys and vals are dense arrays of exactly your key and value types
+//  - next holds the bucket chains, as 32 bit indices instead of pointers
+//  - ctrl is one byte per entry: the free_key/free_val flags, plus 6 bits
+//    of the hash so that we can skip most key compares
+//  - buckets holds the index of the first entry in each chain
+//That works out to about 17 bytes per entry for the uint32_t -> uint32_t
+//case, and lookups only touch the arrays they need.
+//
+//Entries are always packed into indices 0 to size-1. Deleting moves the
+//last entry into the hole, so iterating is just a loop over the arrays.
+//
+//The price is that hashes aren't cached: growing the table and deleting
+//(to fix up the chain of the entry that moved) call the hash function
+//again.
+//
+//Usage is the same as map.h:
+//
+//  cmap m;
+//  cmap_init(&m, uint32_t, uint32_t, VAL2VAL);
+//  cmap_insert(&m, RV_AMP(1), 0, RV_AMP(2), 0);
+//  uint32_t *v = cmap_search(&m, RV_AMP(1));
+//
+//  unsigned long it;
+//  for (it = cmap_begin(&m); it != cmap_end(&m); cmap_iter_step(&m, it)) {
+//      uint32_t k, v;
+//      cmap_iter_deref(&m, it, &k, &v);
+//  }
+//
+//  cmap_free(&m);
+//
+//Pointers returned by cmap_search are only good until the next insert or
+//delete.
+
+#ifndef MM_IMPLEMENT
+//Must be a power of two
+#define CMAP_INIT_SZ 8
+
+//End of a chain (or an empty bucket)
+#define CMAP_NIL ((uint32_t) -1)
+
+//Bits in the ctrl bytes. The other 6 bits are a tag from the hash.
+#define CMAP_FREE_KEY 1
+#define CMAP_FREE_VAL 2
+
+typedef struct {
+    uint32_t *buckets;
+    uint32_t *next;
+    uint8_t *ctrl;
+    void *keys;
+    void *vals;
+
+    uint32_t size;
+    uint32_t capacity; //Number of entries we have room for. Power of two
+    unsigned cap_bits; //There are as many buckets as entries
+
+    map_hash_fn *hash;
+    map_comp_fn *key_comp;
+    map_comp_fn *val_comp;
+    void (*key_free)(void *);
+    void (*val_free)(void *);
+
+    //Same trick as in map.h (see the big comment in the map struct)
+    int key_is_ptr;
+    int val_is_ptr;
+
+    //key_sz and val_sz are what gets passed to the hash and comp functions.
+    //The strides are the actual sizes of the stored types.
+    unsigned key_sz;
+    unsigned val_sz;
+    unsigned key_stride;
+    unsigned val_stride;
+} cmap;
+
+#define cmap_init(m,ktype,vtype,x) EXPAND(DEFER(cmap_custom_init)(m,ktype,vtype,x))
+
+//entries is never used for anything except sizeof. It's called entries so
+//that the VAL2VAL etc. helpers from map.h work here too.
+#define cmap_custom_init(m,ktype,vtype,hsh,kcmp,vcmp,kfree,vfree,ksz,vsz) \
+do {                                                                      \
+    struct { ktype key; vtype val; } entries[1];                          \
+                                                                          \
+    *(m) = (cmap) {                                                       \
+        .hash = hsh,                                                      \
+        .key_comp = kcmp,                                                 \
+        .val_comp = vcmp,                                                 \
+        .key_free = kfree,                                                \
+        .val_free = vfree,                                                \
+                                                                          \
+        .key_is_ptr = (kcmp==map_ptr_comp||kcmp==map_str_comp),           \
+        .val_is_ptr = (vcmp==map_ptr_comp||vcmp==map_str_comp),           \
+                                                                          \
+        .key_sz = ksz,                                                    \
+        .val_sz = vsz,                                                    \
+        .key_stride = sizeof(entries->key),                               \
+        .val_stride = sizeof(entries->val),                               \
+    };                                                                    \
+                                                                          \
+    __cmap_resize(m, CMAP_INIT_SZ);                                       \
+} while(0)
+
+#define cmap_size(m) ((m)->size)
+
+//Iterators are entry indices, and the entries are packed
+#define cmap_begin(m) 0ul
+#define cmap_end(m) ((unsigned long) (m)->size)
+#define cmap_iter_step(m, it) ((it)++)
+#define cmap_iter_deref(m, it, k_dst, v_dst)                           \
+do {                                                                   \
+    memcpy(k_dst, (m)->keys + (it)*(m)->key_stride, (m)->key_stride);  \
+    memcpy(v_dst, (m)->vals + (it)*(m)->val_stride, (m)->val_stride);  \
+} while(0)
+#endif
+
+#ifdef MM_IMPLEMENT
+#define __cmap_key(md, i) ((md)->keys + (i)*(md)->key_stride)
+#define __cmap_val(md, i) ((md)->vals + (i)*(md)->val_stride)
+
+//Fibonacci hashing, same as map.h
+static inline uint32_t __cmap_bucket(cmap const *md, uint32_t hash) {
+    return (uint32_t) (hash * 2654435769u) >> (32 - md->cap_bits);
+}
+
+//The tag can't just be some bits of the hash: the Fibonacci multiply 
+//makes the bucket index depend on all of them, so every entry in a chain 
+//could easily share the same tag. Instead, I mix the hash a second time 
+//(with the first half of murmur3's finalizer, which has nothing to do 
+//with the golden ratio) and take the top 6 bits of that.
+static inline uint8_t __cmap_tag(uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    return (uint8_t) (hash >> 24) & 0xFC;
+}
+#define __cmap_tag_mask ((uint8_t) 0xFC)
+
+//Returns the link (either a bucket or some entry's next) that points at
+//the entry holding pk, or NULL if it isn't there. Returning the link
+//instead of the index makes unlinking easy.
+static uint32_t *__cmap_find_link(cmap const *md, void const *pk, uint32_t hash) {
+    uint8_t tag = __cmap_tag(hash);
+    uint32_t *link = &md->buckets[__cmap_bucket(md, hash)];
+    while (*link != CMAP_NIL) {
+        uint32_t i = *link;
+        if (
+            (md->ctrl[i] & __cmap_tag_mask) == tag &&
+            !md->key_comp(__cmap_key(md, i), pk, md->key_sz)
+        ) {
+            return link;
+        }
+        link = &md->next[i];
+    }
+    return NULL;
+}
+
+//Adds entry i (whose key/val/ctrl are already filled in) to its chain
+static void __cmap_link(cmap *md, uint32_t i, uint32_t hash) {
+    uint32_t *bucket = &md->buckets[__cmap_bucket(md, hash)];
+    md->next[i] = *bucket;
+    *bucket = i;
+}
+
+static void __cmap_fill(
+    cmap *md, uint32_t i, uint32_t hash,
+    void const *pk, int free_key,
+    void const *pv, int free_val
+) {
+    md->ctrl[i] = __cmap_tag(hash) |
+        (free_key ? CMAP_FREE_KEY : 0) |
+        (free_val ? CMAP_FREE_VAL : 0);
+    memcpy(__cmap_key(md, i), pk, md->key_stride);
+    memcpy(__cmap_val(md, i), pv, md->val_stride);
+}
+
+static void __cmap_free_kv(cmap *md, uint32_t i) {
+    if (md->ctrl[i] & CMAP_FREE_KEY) md->key_free(__cmap_key(md, i));
+    if (md->ctrl[i] & CMAP_FREE_VAL) md->val_free(__cmap_val(md, i));
+}
+
+static void *__cmap_realloc(void *p, size_t sz) {
+    p = realloc(p, sz);
+    if (!p) FAST_FAIL("out of memory");
+    return p;
+}
+#endif
+
+//Internal function that sets the capacity to cap (a power of two, at
+//least size) and rebuilds the buckets
+void __cmap_resize(cmap *md, uint32_t cap)
+#ifdef MM_IMPLEMENT
+{
+    md->keys = __cmap_realloc(md->keys, (size_t) cap*md->key_stride);
+    md->vals = __cmap_realloc(md->vals, (size_t) cap*md->val_stride);
+    md->ctrl = __cmap_realloc(md->ctrl, cap);
+    md->next = __cmap_realloc(md->next, (size_t) cap*sizeof(uint32_t));
+    md->buckets = __cmap_realloc(md->buckets, (size_t) cap*sizeof(uint32_t));
+
+    md->capacity = cap;
+    md->cap_bits = __builtin_ctz(cap);
+
+    //All bytes 0xFF is CMAP_NIL
+    memset(md->buckets, 0xFF, (size_t) cap*sizeof(uint32_t));
+    uint32_t i;
+    for (i = 0; i < md->size; i++) {
+        __cmap_link(md, i, md->hash(__cmap_key(md, i), md->key_sz));
+    }
+}
+#else
+;
+#endif
+
+void cmap_free(cmap *md)
+#ifdef MM_IMPLEMENT
+{
+    uint32_t i;
+    for (i = 0; i < md->size; i++) __cmap_free_kv(md, i);
+
+    free(md->buckets);
+    free(md->next);
+    free(md->ctrl);
+    free(md->keys);
+    free(md->vals);
+    memset(md, 0, sizeof(*md));
+}
+#else
+;
+#endif
+
+//Returns pointer to value in the map, or NULL if not found
+void *cmap_search(cmap const *md, void const *k)
+#ifdef MM_IMPLEMENT
+{
+    void const *pk = md->key_is_ptr ? &k : k;
+    uint32_t *link = __cmap_find_link(md, pk, md->hash(pk, md->key_sz));
+    return link ? __cmap_val(md, *link) : NULL;
+}
+#else
+;
+#endif
+
+//Returns 0 on success, 1 if previous value overwritten
+int cmap_insert(
+    cmap *md,
+    void const *k, int free_key,
+    void const *v, int free_val
+)
+#ifdef MM_IMPLEMENT
+{
+    void const *pk = md->key_is_ptr ? &k : k;
+    void const *pv = md->val_is_ptr ? &v : v;
+    uint32_t hash = md->hash(pk, md->key_sz);
+
+    uint32_t *link = __cmap_find_link(md, pk, hash);
+    if (link) {
+        __cmap_free_kv(md, *link);
+        __cmap_fill(md, *link, hash, pk, free_key, pv, free_val);
+        return 1;
+    }
+
+    if (md->size == md->capacity) {
+        if (md->capacity*2 == 0) FAST_FAIL("cmap is too big");
+        __cmap_resize(md, md->capacity*2);
+    }
+
+    uint32_t i = md->size++;
+    __cmap_fill(md, i, hash, pk, free_key, pv, free_val);
+    __cmap_link(md, i, hash);
+
+    return 0;
+}
+#else
+;
+#endif
+
+#ifdef MM_IMPLEMENT
+//Unlinks the entry that link points to, and then moves the last entry
+//into its place so that everything stays packed
+static void __cmap_erase(cmap *md, uint32_t *link) {
+    uint32_t i = *link;
+    __cmap_free_kv(md, i);
+    *link = md->next[i];
+
+    uint32_t last = --md->size;
+    if (i == last) return;
+
+    //Find whatever points at the last entry and point it at i instead
+    uint32_t hash = md->hash(__cmap_key(md, last), md->key_sz);
+    uint32_t *l = &md->buckets[__cmap_bucket(md, hash)];
+    while (*l != last) l = &md->next[*l];
+    *l = i;
+
+    memcpy(__cmap_key(md, i), __cmap_key(md, last), md->key_stride);
+    memcpy(__cmap_val(md, i), __cmap_val(md, last), md->val_stride);
+    md->ctrl[i] = md->ctrl[last];
+    md->next[i] = md->next[last];
+}
+#endif
+
+//Same rules as map_search_delete: searches by k_needle if given (and then
+//also checks v_needle, if given), otherwise by v_needle. Returns 0 if an
+//entry was deleted or 1 if it wasn't found.
+int cmap_search_delete(cmap *md, void const *k_needle, void const *v_needle)
+#ifdef MM_IMPLEMENT
+{
+    void const *pv = md->val_is_ptr ? &v_needle : v_needle;
+    uint32_t *link;
+
+    if (k_needle) {
+        void const *pk = md->key_is_ptr ? &k_needle : k_needle;
+        link = __cmap_find_link(md, pk, md->hash(pk, md->key_sz));
+        if (!link) return 1;
+
+        if (v_needle && md->val_comp(__cmap_val(md, *link), pv, md->val_sz) != 0) {
+            return 1;
+        }
+    } else {
+        //The values are packed, so this is about as fast as a linear scan
+        //gets. We still need the link, though.
+        uint32_t i;
+        for (i = 0; i < md->size; i++) {
+            if (md->val_comp(__cmap_val(md, i), pv, md->val_sz) == 0) break;
+        }
+        if (i == md->size) return 1;
+
+        link = __cmap_find_link(md, __cmap_key(md, i), md->hash(__cmap_key(md, i), md->key_sz));
+    }
+
+    __cmap_erase(md, link);
+    return 0;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
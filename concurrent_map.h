@@ -0,0 +1,443 @@
+#ifdef MM_IMPLEMENT
+	#ifndef CONCURRENT_MAP_H_IMPLEMENTED
+		#define CONCURRENT_MAP_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef CONCURRENT_MAP_H
+		#define CONCURRENT_MAP_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "concurrent_map.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "map.h" //For map_hash_fn and map_val_wyhash
+#include "fast_fail.h"
+
+//A hash map that any number of threads can use at once, without wrapping
+//a map.h map in one big mutex.
+//
+//The keys are split by hash into CONC_MAP_SEGS segments, and each segment
+//is its own little linear probing table with its own lock. Writers only
+//take the lock for their key's segment, so writers on different segments
+//never wait for each other.
+//
+//Readers don't take any locks, and (this is the important part) don't
+//write to any shared memory, so there's no cache line bouncing between
+//cores that are all doing lookups. Each segment has a sequence number:
+//a writer makes it odd before changing anything and even again after.
+//A reader notes the sequence number, does the lookup, then checks that
+//the number didn't change. If it did, the reader just tries again. (This
+//is a seqlock, like the Linux kernel uses for the clock.)
+//
+//Growing a segment doesn't block readers either. The writer builds the
+//bigger table on the side and swaps the pointer. Readers that were still
+//in the old table get a perfectly good (if slightly stale) answer, since
+//nobody writes to an old table again. The catch is that old tables can't
+//be freed until nobody could be looking at them, so they're kept around
+//until conc_map_free. That's at most as much memory as the live tables,
+//since each one is half the size of the one that replaced it.
+//
+//Because readers look at entries that might be changing under them, keys
+//and values are plain bytes that get copied in and out: there's no
+//pointer to the value like map_search returns, and no pointer or string
+//keys (a reader would follow a pointer that a writer just freed). Keys
+//are compared with memcmp, so structs with padding need zeroing.
+//
+//  conc_map sessions;
+//  conc_map_init(&sessions, uint64_t, struct session_info);
+//
+//  //Any thread:
+//  struct session_info info;
+//  if (conc_map_search(&sessions, &sid, &info)) ...
+//  conc_map_insert(&sessions, &sid, &new_info);
+//  conc_map_search_delete(&sessions, &sid, NULL);
+//
+//  conc_map_free(&sessions); //Nobody else can be using it now
+
+#ifndef MM_IMPLEMENT
+//Must be a power of two. 64 segments keeps writers from colliding much,
+//and the segments themselves only cost a cache line each.
+#define CONC_MAP_SEG_BITS 6
+#define CONC_MAP_SEGS (1u << CONC_MAP_SEG_BITS)
+
+//Starting slots in each segment. Must be a power of two
+#define CONC_MAP_INIT_SZ 16
+
+//Max load factor, as a fraction out of 4
+#define CONC_MAP_MAX_LOAD 3
+
+typedef struct __conc_tab {
+    uint32_t mask;
+    struct __conc_tab *prev; //Tables this one replaced
+    void *data; //Points into this same allocation, after meta
+    //The (fixed up, see __conc_hash) hash of the key in each slot, or 0
+    //if it's empty
+    _Atomic uint32_t meta[];
+} __conc_tab;
+
+//Each segment gets its own cache line, so that writers in one segment
+//don't slow down readers in the next
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t count;
+    __conc_tab *_Atomic tab;
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) __conc_seg;
+
+typedef struct {
+    __conc_seg *segs;
+    map_hash_fn *hash;
+    unsigned key_sz;
+    unsigned val_sz;
+    //Keys and values each start on an 8 byte boundary, so they can be
+    //copied a word at a time
+    unsigned val_off;
+    unsigned slot_sz;
+} conc_map;
+
+#define conc_map_init(m, ktype, vtype) \
+    conc_map_custom_init(m, sizeof(ktype), sizeof(vtype), map_val_wyhash)
+#endif
+
+#ifdef MM_IMPLEMENT
+#define __CONC_ROUND8(x) (((x) + 7u) & ~7u)
+
+//0 marks an empty slot, so a real hash of 0 gets bumped to 1. Everything
+//(segment, home slot, meta) uses the fixed-up hash.
+static inline uint32_t __conc_hash(conc_map const *m, void const *k) {
+    uint32_t hash = m->hash(k, m->key_sz);
+    return hash ? hash : 1;
+}
+
+static inline __conc_seg *__conc_seg_of(conc_map const *m, uint32_t hash) {
+    return &m->segs[hash >> (32 - CONC_MAP_SEG_BITS)];
+}
+
+static inline void *__conc_slot(conc_map const *m, __conc_tab *tab, uint32_t i) {
+    return tab->data + (size_t) i * m->slot_sz;
+}
+
+//Readers copy bytes that a writer might be changing at the same time. In C
+//that's only allowed if both sides use atomics, so all the writes to slot
+//data go through here. Relaxed atomics compile to plain loads and stores,
+//so this costs nothing over memcpy. dst is 8 byte aligned, src might not be.
+static void __conc_store(void *dst, void const *src, unsigned sz) {
+    unsigned i;
+    for (i = 0; i + 8 <= sz; i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        __atomic_store_n((uint64_t *) (dst + i), w, __ATOMIC_RELAXED);
+    }
+    for (; i < sz; i++) {
+        __atomic_store_n((uint8_t *) (dst + i), ((uint8_t const *) src)[i], __ATOMIC_RELAXED);
+    }
+}
+
+//The reader's half. src is 8 byte aligned, dst might not be.
+static void __conc_load(void *dst, void const *src, unsigned sz) {
+    unsigned i;
+    for (i = 0; i + 8 <= sz; i += 8) {
+        uint64_t w = __atomic_load_n((uint64_t const *) (src + i), __ATOMIC_RELAXED);
+        memcpy(dst + i, &w, 8);
+    }
+    for (; i < sz; i++) {
+        ((uint8_t *) dst)[i] = __atomic_load_n((uint8_t const *) (src + i), __ATOMIC_RELAXED);
+    }
+}
+
+//Like memcmp(slot_key, k, sz) == 0, but safe against concurrent writers
+static int __conc_key_eq(void const *slot_key, void const *k, unsigned sz) {
+    unsigned i;
+    for (i = 0; i + 8 <= sz; i += 8) {
+        uint64_t a = __atomic_load_n((uint64_t const *) (slot_key + i), __ATOMIC_RELAXED);
+        uint64_t b;
+        memcpy(&b, k + i, 8);
+        if (a != b) return 0;
+    }
+    for (; i < sz; i++) {
+        uint8_t a = __atomic_load_n((uint8_t const *) (slot_key + i), __ATOMIC_RELAXED);
+        if (a != ((uint8_t const *) k)[i]) return 0;
+    }
+    return 1;
+}
+
+static __conc_tab *__conc_new_tab(conc_map const *m, uint32_t sz) {
+    size_t meta_sz = __CONC_ROUND8(sz * sizeof(uint32_t));
+    __conc_tab *tab = calloc(1, sizeof(__conc_tab) + meta_sz + (size_t) sz * m->slot_sz);
+    if (!tab) FAST_FAIL("out of memory");
+    tab->mask = sz - 1;
+    tab->data = ((void *) tab->meta) + meta_sz;
+    return tab;
+}
+
+//Returns the slot holding k, or -1. Safe to call without the lock, but
+//then the answer only means something if the seqlock check passes. The
+//loop is bounded since a reader racing with writers could (in principle)
+//see a table with no empty slots.
+static long __conc_find(conc_map const *m, __conc_tab *tab, void const *k, uint32_t hash) {
+    uint32_t i = hash & tab->mask;
+    uint32_t n;
+    for (n = 0; n <= tab->mask; n++) {
+        uint32_t h = atomic_load_explicit(&tab->meta[i], memory_order_acquire);
+        if (h == 0) return -1;
+        if (h == hash && __conc_key_eq(__conc_slot(m, tab, i), k, m->key_sz)) return i;
+        i = (i + 1) & tab->mask;
+    }
+    return -1;
+}
+
+//Writers only. The slot's data is written before its meta, with release,
+//so a reader that sees the meta also sees the key and value.
+static void __conc_fill(
+    conc_map const *m, __conc_tab *tab, uint32_t i,
+    uint32_t hash, void const *k, void const *v
+) {
+    void *slot = __conc_slot(m, tab, i);
+    __conc_store(slot, k, m->key_sz);
+    __conc_store(slot + m->val_off, v, m->val_sz);
+    atomic_store_explicit(&tab->meta[i], hash, memory_order_release);
+}
+
+//Writers only. Returns the first empty slot in hash's probe sequence
+static uint32_t __conc_empty_slot(__conc_tab *tab, uint32_t hash) {
+    uint32_t i = hash & tab->mask;
+    while (atomic_load_explicit(&tab->meta[i], memory_order_relaxed) != 0) {
+        i = (i + 1) & tab->mask;
+    }
+    return i;
+}
+
+static inline void __conc_write_begin(__conc_seg *seg) {
+    uint32_t seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+    atomic_store_explicit(&seg->seq, seq + 1, memory_order_relaxed);
+    //Keeps the odd seq from being reordered after the writes that follow
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void __conc_write_end(__conc_seg *seg) {
+    uint32_t seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+    atomic_store_explicit(&seg->seq, seq + 1, memory_order_release);
+}
+
+//Lock must be held. Readers carry on in the old table the whole time.
+static __conc_tab *__conc_grow(conc_map const *m, __conc_seg *seg, __conc_tab *tab) {
+    __conc_tab *bigger = __conc_new_tab(m, (tab->mask + 1) * 2);
+    uint32_t i;
+    for (i = 0; i <= tab->mask; i++) {
+        uint32_t h = atomic_load_explicit(&tab->meta[i], memory_order_relaxed);
+        if (h == 0) continue;
+        void *slot = __conc_slot(m, tab, i);
+        __conc_fill(m, bigger, __conc_empty_slot(bigger, h), h, slot, slot + m->val_off);
+    }
+    bigger->prev = tab;
+    atomic_store_explicit(&seg->tab, bigger, memory_order_release);
+    return bigger;
+}
+#endif
+
+void conc_map_custom_init(conc_map *m, unsigned key_sz, unsigned val_sz, map_hash_fn *hash)
+#ifdef MM_IMPLEMENT
+{
+    m->hash = hash;
+    m->key_sz = key_sz;
+    m->val_sz = val_sz;
+    m->val_off = __CONC_ROUND8(key_sz);
+    m->slot_sz = m->val_off + __CONC_ROUND8(val_sz);
+
+    m->segs = aligned_alloc(64, CONC_MAP_SEGS * sizeof(__conc_seg));
+    if (!m->segs) FAST_FAIL("out of memory");
+
+    unsigned s;
+    for (s = 0; s < CONC_MAP_SEGS; s++) {
+        __conc_seg *seg = &m->segs[s];
+        atomic_init(&seg->seq, 0);
+        atomic_init(&seg->count, 0);
+        atomic_init(&seg->tab, __conc_new_tab(m, CONC_MAP_INIT_SZ));
+        pthread_mutex_init(&seg->lock, NULL);
+    }
+}
+#else
+;
+#endif
+
+//Nobody can be using the map anymore
+void conc_map_free(conc_map *m)
+#ifdef MM_IMPLEMENT
+{
+    unsigned s;
+    for (s = 0; s < CONC_MAP_SEGS; s++) {
+        __conc_seg *seg = &m->segs[s];
+        __conc_tab *tab = atomic_load(&seg->tab);
+        while (tab) {
+            __conc_tab *prev = tab->prev;
+            free(tab);
+            tab = prev;
+        }
+        pthread_mutex_destroy(&seg->lock);
+    }
+    free(m->segs);
+    m->segs = NULL;
+}
+#else
+;
+#endif
+
+//If k is in the map, copies its value into v_dst (if not NULL) and
+//returns 1. Otherwise returns 0. Never takes a lock.
+int conc_map_search(conc_map const *m, void const *k, void *v_dst)
+#ifdef MM_IMPLEMENT
+{
+    uint32_t hash = __conc_hash(m, k);
+    __conc_seg *seg = __conc_seg_of(m, hash);
+
+    while (1) {
+        uint32_t seq = atomic_load_explicit(&seg->seq, memory_order_acquire);
+        if (seq & 1) continue; //A writer is busy in this segment
+
+        __conc_tab *tab = atomic_load_explicit(&seg->tab, memory_order_acquire);
+        long i = __conc_find(m, tab, k, hash);
+        if (i >= 0 && v_dst) {
+            __conc_load(v_dst, __conc_slot(m, tab, i) + m->val_off, m->val_sz);
+        }
+
+        //Makes sure everything we read above is done before we look at
+        //seq again
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&seg->seq, memory_order_relaxed) == seq) {
+            return i >= 0;
+        }
+    }
+}
+#else
+;
+#endif
+
+//Returns 0 if k was added, or 1 if it was already there (in which case its
+//value was overwritten)
+int conc_map_insert(conc_map *m, void const *k, void const *v)
+#ifdef MM_IMPLEMENT
+{
+    uint32_t hash = __conc_hash(m, k);
+    __conc_seg *seg = __conc_seg_of(m, hash);
+
+    pthread_mutex_lock(&seg->lock);
+    __conc_tab *tab = atomic_load_explicit(&seg->tab, memory_order_relaxed);
+
+    long i = __conc_find(m, tab, k, hash);
+    if (i >= 0) {
+        //Readers could see half of the old value and half of the new one,
+        //so this needs the seqlock
+        __conc_write_begin(seg);
+        __conc_store(__conc_slot(m, tab, i) + m->val_off, v, m->val_sz);
+        __conc_write_end(seg);
+        pthread_mutex_unlock(&seg->lock);
+        return 1;
+    }
+
+    uint32_t count = atomic_load_explicit(&seg->count, memory_order_relaxed);
+    if ((uint64_t) (count + 1) * 4 > (uint64_t) (tab->mask + 1) * CONC_MAP_MAX_LOAD) {
+        tab = __conc_grow(m, seg, tab);
+    }
+
+    //Filling an empty slot doesn't move anything, and the release store of
+    //the meta publishes the whole slot at once, so no seqlock needed here.
+    //A reader that already went past this slot just didn't see the key,
+    //which is fine: it started looking before we were done.
+    __conc_fill(m, tab, __conc_empty_slot(tab, hash), hash, k, v);
+    atomic_store_explicit(&seg->count, count + 1, memory_order_relaxed);
+
+    pthread_mutex_unlock(&seg->lock);
+    return 0;
+}
+#else
+;
+#endif
+
+//Removes k, copying its value into v_dst first (if not NULL). Returns 0 if
+//k was removed, or 1 if it wasn't there.
+int conc_map_search_delete(conc_map *m, void const *k, void *v_dst)
+#ifdef MM_IMPLEMENT
+{
+    uint32_t hash = __conc_hash(m, k);
+    __conc_seg *seg = __conc_seg_of(m, hash);
+
+    pthread_mutex_lock(&seg->lock);
+    __conc_tab *tab = atomic_load_explicit(&seg->tab, memory_order_relaxed);
+
+    long i = __conc_find(m, tab, k, hash);
+    if (i < 0) {
+        pthread_mutex_unlock(&seg->lock);
+        return 1;
+    }
+    if (v_dst) memcpy(v_dst, __conc_slot(m, tab, i) + m->val_off, m->val_sz);
+
+    //Same backward shift as rh_map.h: walk the rest of the run and pull
+    //back anything that's allowed to sit in the hole, so there are never
+    //any tombstones. Entries move around, so readers have to retry.
+    __conc_write_begin(seg);
+    uint32_t hole = i;
+    uint32_t j = (hole + 1) & tab->mask;
+    while (1) {
+        uint32_t h = atomic_load_explicit(&tab->meta[j], memory_order_relaxed);
+        if (h == 0) break;
+
+        //The entry at j can move to the hole unless its home is somewhere
+        //after the hole (cyclically)
+        uint32_t home = h & tab->mask;
+        if (((j - home) & tab->mask) >= ((j - hole) & tab->mask)) {
+            void *slot = __conc_slot(m, tab, j);
+            __conc_fill(m, tab, hole, h, slot, slot + m->val_off);
+            hole = j;
+        }
+        j = (j + 1) & tab->mask;
+    }
+    atomic_store_explicit(&tab->meta[hole], 0, memory_order_relaxed);
+    __conc_write_end(seg);
+
+    uint32_t count = atomic_load_explicit(&seg->count, memory_order_relaxed);
+    atomic_store_explicit(&seg->count, count - 1, memory_order_relaxed);
+
+    pthread_mutex_unlock(&seg->lock);
+    return 0;
+}
+#else
+;
+#endif
+
+//Number of keys in the map. If other threads are changing the map, this
+//is only a rough idea.
+uint32_t conc_map_size(conc_map const *m)
+#ifdef MM_IMPLEMENT
+{
+    uint32_t ret = 0;
+    unsigned s;
+    for (s = 0; s < CONC_MAP_SEGS; s++) {
+        ret += atomic_load_explicit(&m->segs[s].count, memory_order_relaxed);
+    }
+    return ret;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MM_IMPLEMENT
+#include "../map.h"
+
+#define NUM_INSERTS (4ul << 20)
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+//Inserts NUM_INSERTS keys one at a time and prints the slowest single
+//insert. With step = 0, the slowest one is whichever insert hit the last
+//resize, and it has to move every entry in the map. With incremental
+//resizing that should drop to roughly the cost of allocating the new
+//table, no matter how big the map gets.
+static void run(unsigned step) {
+    map m;
+    map_init(&m, uint64_t, uint64_t, VAL2VAL);
+    map_set_incremental(&m, step);
+
+    double worst = 0, total = 0;
+    unsigned long worst_at = 0;
+
+    unsigned long i;
+    for (i = 0; i < NUM_INSERTS; i++) {
+        uint64_t k = i*0x9E3779B97F4A7C15ull, v = i;
+
+        double start = now_ms();
+        map_insert(&m, &k, 0, &v, 0);
+        double elapsed = now_ms() - start;
+
+        total += elapsed;
+        if (elapsed > worst) {
+            worst = elapsed;
+            worst_at = i;
+        }
+    }
+
+    printf(
+        "step = %u: %lu inserts in %.1f ms, worst was %.3f ms (insert #%lu, "
+        "map had %u slots at the end)\n",
+        step, NUM_INSERTS, total, worst, worst_at, m.slots
+    );
+
+    map_free(&m);
+}
+
+int main() {
+    run(0);
+    run(1);
+    run(4);
+
+    return 0;
+}
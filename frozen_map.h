@@ -0,0 +1,672 @@
+#ifdef MM_IMPLEMENT
+	#ifndef FROZEN_MAP_H_IMPLEMENTED
+		#define FROZEN_MAP_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef FROZEN_MAP_H
+		#define FROZEN_MAP_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "frozen_map.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "map.h"
+#include "fast_fail.h"
+
+//Read-only snapshots of a map.h map, for tables that get built once (or
+//rarely) and then read all the time, like routing or config tables.
+//
+//map_freeze copies a map into a single block of memory laid out for
+//searching and nothing else: no list pointers, no flags, no empty slots
+//to probe past. Every key gets its own slot from a perfect hash function
+//(built with CHD, "compress, hash, and displace"): the keys are split into
+//small buckets, and each bucket gets a displacement number that was picked
+//so its keys land in slots nobody else is using. A search is then:
+//  - hash the key once
+//  - read its bucket's displacement
+//  - go straight to the one slot it could possibly be in
+//so at most two cache misses, and never a probe loop.
+//
+//Since a snapshot never changes, any number of threads can search it with
+//no locks at all. To change the table, freeze a new snapshot and swap it
+//in with frozen_map_publish:
+//
+//  frozen_map *_Atomic routes;
+//
+//  //Whoever rebuilds the config:
+//  map m;
+//  map_init(&m, char const*, struct route, STR2VAL);
+//  ... map_insert as usual ...
+//  frozen_map *old = frozen_map_publish(&routes, map_freeze(&m));
+//  map_free(&m);
+//  ... once no reader can still be using old ...
+//  frozen_map_free(old);
+//
+//  //Readers:
+//  frozen_map const *fm = frozen_map_current(&routes);
+//  struct route const *r = frozen_map_search(fm, path);
+//
+//Knowing when no reader can still be using the old snapshot is up to you
+//(for example, wait until every worker has finished the request it was on).
+//
+//Pointer and string keys and values are deep copied into the snapshot, so
+//it doesn't depend on the original map at all. The key hashing needs to
+//agree with the key comparison, so only map.h's own comparisons
+//(map_val_comp, map_ptr_comp and map_str_comp) are allowed for keys.
+//
+//A snapshot of a map with plain value keys and values (VAL2VAL) doesn't
+//contain a single pointer, only offsets, so it can be saved to a file and
+//used straight from there later. map_mmap_load maps the file read-only and
+//searches it in place: nothing is rebuilt or even read until a search
+//touches it, and the data lives in the page cache where every process
+//using the file shares it.
+//
+//  //Once, after building the table:
+//  map_save(&m, "routes.bin");
+//
+//  //At startup:
+//  frozen_map *fm = map_mmap_load("routes.bin", sizeof(uint64_t), sizeof(struct route));
+//  if (!fm) ... //errno says why
+//  struct route const *r = frozen_map_search(fm, &id);
+//  ...
+//  frozen_map_free(fm); //Unmaps the file
+//
+//The file uses the byte order and struct layout of the machine that wrote
+//it, so only load it on the same kind of machine (with the same key and
+//value types).
+
+#ifndef MM_IMPLEMENT
+//Average number of keys per bucket. Bigger means less memory for the
+//displacements, but a slower map_freeze
+#define FROZEN_BUCKET_LOAD 4
+
+//There's one spare slot for every FROZEN_SLACK_DIV keys. Fewer spares
+//makes map_freeze take longer to find a place for the last few keys.
+#define FROZEN_SLACK_DIV 16
+
+//If some bucket can't be placed after this many displacements, we start
+//over with a different seed
+#define FROZEN_MAX_TRIES (1u << 16)
+
+typedef struct {
+    uint32_t count;
+    uint32_t nslots;
+    uint32_t nbuckets;
+    uint64_t seed;
+
+    uint32_t const *disp; //One displacement per bucket
+    //Each slot is a uint32_t tag (0 if the slot is empty), then the key
+    //and value in the same format as a map entry. Both start on 8 byte
+    //boundaries.
+    void const *slots;
+    unsigned slot_sz;
+    unsigned key_off;
+    unsigned key_sz;
+    unsigned val_off;
+    unsigned val_sz;
+
+    int key_is_ptr;
+    int val_is_ptr;
+    map_comp_fn *key_comp;
+    map_comp_fn *val_comp;
+
+    //If the snapshot came from map_mmap_load, the mapping to undo in
+    //frozen_map_free. Otherwise NULL.
+    void *mapped;
+    size_t mapped_sz;
+} frozen_map;
+
+#define frozen_map_size(fm) ((fm)->count)
+#endif
+
+#ifdef MM_IMPLEMENT
+#define __FROZEN_ROUND8(x) (((x) + (size_t) 7) & ~(size_t) 7)
+
+//splitmix64's finalizer
+static inline uint64_t __frozen_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+//Maps a 32 bit number onto [0, n) without a division
+static inline uint32_t __frozen_range(uint32_t x, uint32_t n) {
+    return (uint32_t) (((uint64_t) x * n) >> 32);
+}
+
+//pk is a pointer to the key, same as everywhere in map.h
+static uint64_t __frozen_hash(frozen_map const *fm, void const *pk) {
+    if (fm->key_comp == map_str_comp) {
+        char const *s = *(char const **) pk;
+        return map_hash64(s, strlen(s), fm->seed);
+    } else if (fm->key_comp == map_ptr_comp) {
+        return map_hash64(*(void const **) pk, fm->key_sz, fm->seed);
+    } else {
+        return map_hash64(pk, fm->key_sz, fm->seed);
+    }
+}
+
+//The top half of the hash picks the bucket, and the bottom half is the
+//tag. The slot comes from remixing the whole thing with the displacement.
+static inline uint32_t __frozen_bucket(frozen_map const *fm, uint64_t h) {
+    return __frozen_range(h >> 32, fm->nbuckets);
+}
+
+static inline uint32_t __frozen_tag(uint64_t h) {
+    return (uint32_t) h | 1;
+}
+
+static inline uint32_t __frozen_pos(frozen_map const *fm, uint64_t h, uint32_t d) {
+    return __frozen_range(__frozen_mix(h + d*0x9E3779B97F4A7C15ull), fm->nslots);
+}
+
+//Size of the copy of a pointer key or value (including the NUL for strings)
+static size_t __frozen_pointee_sz(map_comp_fn *comp, void const *p, unsigned sz) {
+    if (!p) return 0;
+    if (comp == map_str_comp) return strlen(p) + 1;
+    return sz;
+}
+
+//Copies a key or value field into a slot. Pointer fields get their pointee
+//copied to *heap.
+static void __frozen_copy_field(
+    void *dst, void const *src,
+    int is_ptr, map_comp_fn *comp, unsigned sz,
+    void **heap
+) {
+    if (!is_ptr) {
+        memcpy(dst, src, sz);
+        return;
+    }
+
+    void const *p = *(void const **) src;
+    size_t n = __frozen_pointee_sz(comp, p, sz);
+    void *copy = p ? *heap : NULL;
+    if (p) {
+        memcpy(copy, p, n);
+        *heap += __FROZEN_ROUND8(n);
+    }
+    memcpy(dst, &copy, sizeof(void*));
+}
+
+typedef struct {
+    uint32_t start; //Index into the sorted key list
+    uint32_t len;
+} __frozen_bucket_info;
+
+//Tries to find displacements for every bucket with the seed in fm, given
+//the hashes of all the keys. Fills in disp, and the slot for each key in
+//slot_of. Returns 0 on success.
+static int __frozen_place(
+    frozen_map *fm, uint32_t *disp,
+    uint64_t const *hashes, uint32_t *slot_of
+) {
+    uint32_t n = fm->count;
+    uint32_t nb = fm->nbuckets;
+
+    //Counting sort of the keys by bucket
+    __frozen_bucket_info *b = calloc(nb + 1, sizeof(*b));
+    uint32_t *order = malloc(nb * sizeof(uint32_t));
+    uint32_t *sorted = malloc((n + 1) * sizeof(uint32_t));
+    //One bit per slot. This gets hit at random over and over, so keeping it
+    //small enough to stay in cache matters a lot
+    uint64_t *taken = calloc(fm->nslots/64 + 1, sizeof(uint64_t));
+    if (!b || !order || !sorted || !taken) FAST_FAIL("out of memory");
+
+    uint32_t i;
+    uint32_t max_len = 0;
+    for (i = 0; i < n; i++) {
+        uint32_t len = ++b[__frozen_bucket(fm, hashes[i])].len;
+        if (len > max_len) max_len = len;
+    }
+
+    //Big buckets are the hardest to place, so they go first while the
+    //table is still mostly empty. This is another counting sort, by length
+    uint32_t *by_len = calloc(max_len + 2, sizeof(uint32_t));
+    if (!by_len) FAST_FAIL("out of memory");
+    for (i = 0; i < nb; i++) by_len[max_len - b[i].len + 1]++;
+    for (i = 1; i <= max_len + 1; i++) by_len[i] += by_len[i - 1];
+    for (i = 0; i < nb; i++) order[by_len[max_len - b[i].len]++] = i;
+    free(by_len);
+
+    uint32_t start = 0;
+    for (i = 0; i < nb; i++) {
+        b[i].start = start;
+        start += b[i].len;
+        b[i].len = 0;
+    }
+    for (i = 0; i < n; i++) {
+        __frozen_bucket_info *bi = &b[__frozen_bucket(fm, hashes[i])];
+        sorted[bi->start + bi->len++] = i;
+    }
+
+    int ret = 0;
+    for (i = 0; i < nb && b[order[i]].len > 0; i++) {
+        __frozen_bucket_info *bi = &b[order[i]];
+        uint32_t d;
+        for (d = 0; d < FROZEN_MAX_TRIES; d++) {
+            uint32_t j;
+            for (j = 0; j < bi->len; j++) {
+                uint32_t k = sorted[bi->start + j];
+                uint32_t pos = __frozen_pos(fm, hashes[k], d);
+                uint64_t bit = 1ull << (pos & 63);
+                if (taken[pos >> 6] & bit) break;
+                taken[pos >> 6] |= bit;
+                slot_of[k] = pos;
+            }
+            if (j == bi->len) break;
+
+            //Undo the ones we grabbed (this also catches two keys from
+            //the same bucket wanting the same slot)
+            while (j-- > 0) {
+                uint32_t pos = slot_of[sorted[bi->start + j]];
+                taken[pos >> 6] &= ~(1ull << (pos & 63));
+            }
+        }
+        if (d == FROZEN_MAX_TRIES) {
+            ret = -1;
+            break;
+        }
+        disp[order[i]] = d;
+    }
+    //Empty buckets keep displacement 0, from the calloc in map_freeze
+
+    free(b);
+    free(order);
+    free(sorted);
+    free(taken);
+    return ret;
+}
+#endif
+
+//Makes a read-only snapshot of md. md isn't changed (it isn't const
+//because iterating finishes any incremental resize it had going), and
+//can be freed or keep being used afterwards. Free the snapshot with
+//frozen_map_free.
+frozen_map *map_freeze(map *md)
+#ifdef MM_IMPLEMENT
+{
+    if (md->key_comp != map_val_comp &&
+        md->key_comp != map_ptr_comp &&
+        md->key_comp != map_str_comp
+    ) {
+        FAST_FAIL("map_freeze only works with map.h's own key comparisons");
+    }
+
+    uint32_t n = map_size(md);
+    frozen_map tmp = {
+        .count = n,
+        .nslots = n + n/FROZEN_SLACK_DIV + 1,
+        .nbuckets = n/FROZEN_BUCKET_LOAD + 1,
+        .seed = 0,
+
+        .key_sz = md->key_sz,
+        .val_sz = md->val_sz,
+        .key_is_ptr = md->key_is_ptr,
+        .val_is_ptr = md->val_is_ptr,
+        .key_comp = md->key_comp,
+        .val_comp = md->val_comp,
+    };
+    unsigned key_field = md->key_is_ptr ? sizeof(void*) : md->key_sz;
+    unsigned val_field = md->val_is_ptr ? sizeof(void*) : md->val_sz;
+    tmp.key_off = 8;
+    tmp.val_off = tmp.key_off + __FROZEN_ROUND8(key_field);
+    tmp.slot_sz = tmp.val_off + __FROZEN_ROUND8(val_field);
+
+    //Gather up the entries, and figure out how much room the copies of
+    //pointer keys and values need
+    void **ents = malloc((n + 1) * sizeof(void*));
+    uint64_t *hashes = malloc((n + 1) * sizeof(uint64_t));
+    uint32_t *slot_of = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *disp = calloc(tmp.nbuckets, sizeof(uint32_t));
+    if (!ents || !hashes || !slot_of || !disp) FAST_FAIL("out of memory");
+
+    //Walking the table in order is a lot kinder to the cache than following
+    //the list of filled entries, which jumps all over the place
+    __map_rehash_finish(md);
+    size_t heap_sz = 0;
+    uint32_t i = 0;
+    uint32_t slot;
+    for (slot = 1; slot <= md->slots; slot++) {
+        void *entry = md->entries + (size_t) slot * md->entry_sz;
+        __entry_flags *flags = entry + md->flag_off;
+        if (!flags->is_filled) continue;
+
+        ents[i++] = entry;
+        if (md->key_is_ptr) {
+            void const *p = *(void const **) (entry + md->key_off);
+            heap_sz += __FROZEN_ROUND8(__frozen_pointee_sz(md->key_comp, p, md->key_sz));
+        }
+        if (md->val_is_ptr) {
+            void const *p = *(void const **) (entry + md->val_off);
+            heap_sz += __FROZEN_ROUND8(__frozen_pointee_sz(md->val_comp, p, md->val_sz));
+        }
+    }
+
+    //Find a perfect hash. With these load factors the first seed almost
+    //always works
+    while (1) {
+        for (i = 0; i < n; i++) hashes[i] = __frozen_hash(&tmp, ents[i] + md->key_off);
+        if (__frozen_place(&tmp, disp, hashes, slot_of) == 0) break;
+        tmp.seed++;
+        memset(disp, 0, tmp.nbuckets * sizeof(uint32_t));
+    }
+
+    //Everything goes in one allocation: the struct, the displacements,
+    //the slots, and then the copies of pointer keys and values
+    size_t disp_off = __FROZEN_ROUND8(sizeof(frozen_map));
+    size_t slots_off = disp_off + __FROZEN_ROUND8(tmp.nbuckets * sizeof(uint32_t));
+    size_t heap_off = slots_off + (size_t) tmp.nslots * tmp.slot_sz;
+    frozen_map *fm = calloc(1, heap_off + heap_sz);
+    if (!fm) FAST_FAIL("out of memory");
+
+    *fm = tmp;
+    memcpy(((void*)fm) + disp_off, disp, tmp.nbuckets * sizeof(uint32_t));
+    fm->disp = ((void*)fm) + disp_off;
+    void *slots = ((void*)fm) + slots_off;
+    fm->slots = slots;
+
+    void *heap = ((void*)fm) + heap_off;
+    for (i = 0; i < n; i++) {
+        void *slot = slots + (size_t) slot_of[i] * fm->slot_sz;
+        *(uint32_t *) slot = __frozen_tag(hashes[i]);
+        __frozen_copy_field(
+            slot + fm->key_off, ents[i] + md->key_off,
+            fm->key_is_ptr, fm->key_comp, fm->key_sz, &heap
+        );
+        __frozen_copy_field(
+            slot + fm->val_off, ents[i] + md->val_off,
+            fm->val_is_ptr, fm->val_comp, fm->val_sz, &heap
+        );
+    }
+
+    free(ents);
+    free(hashes);
+    free(slot_of);
+    free(disp);
+    return fm;
+}
+#else
+;
+#endif
+
+void frozen_map_free(frozen_map *fm)
+#ifdef MM_IMPLEMENT
+{
+    if (fm->mapped) munmap(fm->mapped, fm->mapped_sz);
+    //Otherwise it's all one allocation
+    free(fm);
+}
+#else
+;
+#endif
+
+//Same as map_search: returns a pointer to the value, or NULL if k isn't
+//there. Keys are passed the same way as for map_search.
+void const *frozen_map_search(frozen_map const *fm, void const *k)
+#ifdef MM_IMPLEMENT
+{
+    void const *pk = fm->key_is_ptr ? &k : k;
+    uint64_t h = __frozen_hash(fm, pk);
+    uint32_t d = fm->disp[__frozen_bucket(fm, h)];
+    void const *slot = fm->slots + (size_t) __frozen_pos(fm, h, d) * fm->slot_sz;
+
+    //The tag check means that most misses never have to compare keys (and
+    //it's how we tell that a slot is empty)
+    if (*(uint32_t const *) slot != __frozen_tag(h)) return NULL;
+    if (fm->key_comp(slot + fm->key_off, pk, fm->key_sz) != 0) return NULL;
+    return slot + fm->val_off;
+}
+#else
+;
+#endif
+
+//Atomically makes fm the current snapshot in *where, and returns the one
+//it replaced (or NULL). Readers that already got the old snapshot can keep
+//using it, so don't free it until they're done.
+frozen_map *frozen_map_publish(frozen_map *_Atomic *where, frozen_map *fm)
+#ifdef MM_IMPLEMENT
+{
+    return atomic_exchange_explicit(where, fm, memory_order_acq_rel);
+}
+#else
+;
+#endif
+
+//Gets the current snapshot from *where (or NULL if nothing was published)
+frozen_map const *frozen_map_current(frozen_map *_Atomic *where)
+#ifdef MM_IMPLEMENT
+{
+    return atomic_load_explicit(where, memory_order_acquire);
+}
+#else
+;
+#endif
+
+#ifdef MM_IMPLEMENT
+#define __FROZEN_MAGIC "mmfrozen"
+#define __FROZEN_VERSION 1
+
+//Start of a saved snapshot. Everything else in the file is found with
+//offsets from the start of the file.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; //0x01020304, as written by the saving machine
+
+    uint32_t count;
+    uint32_t nslots;
+    uint32_t nbuckets;
+    uint32_t slot_sz;
+    uint32_t key_off;
+    uint32_t key_sz;
+    uint32_t val_off;
+    uint32_t val_sz;
+    uint64_t seed;
+
+    uint64_t disp_off;
+    uint64_t slots_off;
+    uint64_t file_sz;
+} __frozen_file_hdr;
+#endif
+
+//Writes fm to a file that map_mmap_load can use. fm has to be from a map
+//with plain value keys and values (a pointer in the file would be
+//meaningless when it's loaded). Returns 0 on success, or -1 and sets errno
+//(to EINVAL if fm has pointer or string keys or values).
+int frozen_map_save(frozen_map const *fm, char const *path)
+#ifdef MM_IMPLEMENT
+{
+    if (fm->key_is_ptr || fm->val_is_ptr || fm->key_comp != map_val_comp) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t disp_sz = fm->nbuckets * sizeof(uint32_t);
+    size_t slots_sz = (size_t) fm->nslots * fm->slot_sz;
+
+    __frozen_file_hdr hdr = {
+        .magic = __FROZEN_MAGIC,
+        .version = __FROZEN_VERSION,
+        .byte_order = 0x01020304,
+
+        .count = fm->count,
+        .nslots = fm->nslots,
+        .nbuckets = fm->nbuckets,
+        .slot_sz = fm->slot_sz,
+        .key_off = fm->key_off,
+        .key_sz = fm->key_sz,
+        .val_off = fm->val_off,
+        .val_sz = fm->val_sz,
+        .seed = fm->seed,
+    };
+    //Keeps the slots 8 byte aligned in the file (and so in memory too,
+    //since mmap gives back page aligned addresses)
+    hdr.disp_off = __FROZEN_ROUND8(sizeof(hdr));
+    hdr.slots_off = hdr.disp_off + __FROZEN_ROUND8(disp_sz);
+    hdr.file_sz = hdr.slots_off + slots_sz;
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+
+    static char const zeros[8];
+    size_t pad1 = hdr.disp_off - sizeof(hdr);
+    size_t pad2 = hdr.slots_off - hdr.disp_off - disp_sz;
+    int ok =
+        fwrite(&hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+        fwrite(zeros, 1, pad1, fp) == pad1 &&
+        fwrite(fm->disp, 1, disp_sz, fp) == disp_sz &&
+        fwrite(zeros, 1, pad2, fp) == pad2 &&
+        fwrite(fm->slots, 1, slots_sz, fp) == slots_sz
+    ;
+
+    //fclose can also be where a write error first shows up
+    if (fclose(fp) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+#else
+;
+#endif
+
+//Freezes md and saves it with frozen_map_save. md must use plain value keys
+//and values (see frozen_map_save). Returns 0 on success, or -1 and sets
+//errno (to EINVAL if md has pointer or string keys or values).
+int map_save(map *md, char const *path)
+#ifdef MM_IMPLEMENT
+{
+    //Check before freezing, so we don't build a whole snapshot for nothing
+    if (md->key_is_ptr || md->val_is_ptr || md->key_comp != map_val_comp) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    frozen_map *fm = map_freeze(md);
+    int ret = frozen_map_save(fm, path);
+    frozen_map_free(fm);
+    return ret;
+}
+#else
+;
+#endif
+
+//Maps a file from map_save (read-only) and returns a snapshot that searches
+//it in place. key_sz and val_sz are the sizes of your key and value types,
+//and have to match what was saved. Returns NULL and sets errno if the file
+//can't be opened or mapped, or EINVAL if it isn't a valid snapshot (or the
+//sizes don't match). Free it with frozen_map_free.
+frozen_map *map_mmap_load(char const *path, unsigned key_sz, unsigned val_sz)
+#ifdef MM_IMPLEMENT
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t) st.st_size < sizeof(__frozen_file_hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t sz = st.st_size;
+    void *mapped = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); //The mapping keeps the file alive
+    if (mapped == MAP_FAILED) return NULL;
+
+    //Don't trust anything in the file until it all checks out, since a bad
+    //offset would have frozen_map_search reading outside the mapping
+    __frozen_file_hdr const *hdr = mapped;
+    int ok =
+        !memcmp(hdr->magic, __FROZEN_MAGIC, sizeof(hdr->magic)) &&
+        hdr->version == __FROZEN_VERSION &&
+        hdr->byte_order == 0x01020304 &&
+        hdr->file_sz == sz &&
+        hdr->key_sz == key_sz &&
+        hdr->val_sz == val_sz &&
+        hdr->nslots > 0 &&
+        hdr->nbuckets > 0 &&
+        hdr->count <= hdr->nslots &&
+        hdr->key_off >= sizeof(uint32_t) &&
+        hdr->val_off >= hdr->key_off + (uint64_t) hdr->key_sz &&
+        hdr->slot_sz >= hdr->val_off + (uint64_t) hdr->val_sz &&
+        hdr->disp_off % 8 == 0 &&
+        hdr->slots_off % 8 == 0 &&
+        hdr->disp_off >= sizeof(*hdr) &&
+        //Written as divisions so that huge offsets in a corrupt file can't 
+        //wrap around (slot_sz can't be 0, because of the checks above)
+        hdr->disp_off <= hdr->slots_off &&
+        hdr->slots_off <= sz &&
+        hdr->nbuckets <= (hdr->slots_off - hdr->disp_off) / sizeof(uint32_t) &&
+        hdr->nslots <= (sz - hdr->slots_off) / hdr->slot_sz
+    ;
+    if (!ok) {
+        munmap(mapped, sz);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    frozen_map *fm = malloc(sizeof(frozen_map));
+    if (!fm) FAST_FAIL("out of memory");
+    *fm = (frozen_map) {
+        .count = hdr->count,
+        .nslots = hdr->nslots,
+        .nbuckets = hdr->nbuckets,
+        .seed = hdr->seed,
+
+        .disp = mapped + hdr->disp_off,
+        .slots = mapped + hdr->slots_off,
+        .slot_sz = hdr->slot_sz,
+        .key_off = hdr->key_off,
+        .key_sz = hdr->key_sz,
+        .val_off = hdr->val_off,
+        .val_sz = hdr->val_sz,
+
+        .key_is_ptr = 0,
+        .val_is_ptr = 0,
+        .key_comp = map_val_comp,
+        .val_comp = map_val_comp,
+
+        .mapped = mapped,
+        .mapped_sz = sz,
+    };
+
+    //A bad displacement can't send a search outside the slots (every
+    //position is taken mod nslots), so there's no need to check them all
+    return fm;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
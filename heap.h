@@ -23,6 +23,7 @@
 #define MM_IMPLEMENT 1
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include "fast_fail.h"
 
@@ -171,6 +172,142 @@ do {                                                  \
 } while(0)
 #endif
 
-//TODO: heapify
+//Rearranges the n elements in base so that they form a heap. This is the 
+//usual bottom-up method (each subtree is fixed up starting from the last 
+//parent), which is O(n) instead of the O(n log n) you get from n inserts.
+void __heapify(void *base, unsigned elem_sz, unsigned n, compar_fn *cmp)
+#ifdef MM_IMPLEMENT
+{
+	if (n < 2) return; //Nothing to do
+	
+	//bubble_upwards needs somewhere to keep the element while it 
+	//moves children up into the hole
+	void *tmp = malloc(elem_sz);
+	if (!tmp) FAST_FAIL("out of memory");
+	
+	//n/2 - 1 is the last node that has at least one child
+	unsigned i = n/2;
+	while (i --> 0) {
+		memcpy(tmp, base + i*elem_sz, elem_sz);
+		bubble_upwards(base, tmp, elem_sz, i, n, cmp);
+	}
+	
+	free(tmp);
+}
+#else
+;
+#define heapify(h, n, cmp) \
+	__heapify(h, sizeof(*(h)), n, cmp)
+
+#define vector_heapify(v, cmp) \
+	__heapify(v, sizeof(*(v)), v##_len, cmp)
+#endif
+
+//Adds k elements (stored contiguously at elems) to the heap. Like in
+//__heap_insert, n should be the size of the heap INCLUDING the k elements
+//we are about to add. If k is big compared to the heap, it's cheaper to
+//tack the new elements onto the end and heapify everything than to do k
+//separate inserts. elems may not point into base.
+void __heap_insert_n(
+	void *base, void const *elems, unsigned elem_sz, 
+	unsigned k, unsigned n, compar_fn *cmp)
+#ifdef MM_IMPLEMENT
+{
+	if (k > n) {
+		FAST_FAIL("Inserting more elements than the heap can hold");
+	}
+	
+	//Rough cost estimates: k inserts take about k*log2(n) compares 
+	//in the worst case, and heapify takes about 2*n.
+	unsigned lg = 0;
+	while ((1u << lg) < n && lg < 31) lg++;
+	
+	if ((unsigned long long) k * lg > 2ull * n) {
+		memcpy(base + (n-k)*elem_sz, elems, (unsigned long long) k*elem_sz);
+		__heapify(base, elem_sz, n, cmp);
+		return;
+	}
+	
+	unsigned i;
+	for (i = 0; i < k; i++) {
+		unsigned cur_n = n - k + i + 1;
+		bubble_downwards(base, elems + i*elem_sz, elem_sz, cur_n-1, cur_n, cmp);
+	}
+}
+#else
+;
+#define heap_insert_n(h, e, k, n, cmp) \
+	__heap_insert_n(h, e, sizeof(*(h)), k, n, cmp)
+
+#define vector_heap_insert_n(v, e, k, cmp)                    \
+do {                                                          \
+	vector_reserve(v, v##_len + (k));                         \
+	v##_len += (k);                                           \
+	__heap_insert_n(v, e, sizeof(*(v)), k, v##_len, cmp);     \
+} while(0)
+
+//Merging two heaps is exactly the same thing as inserting all the elements 
+//of one of them into the other. There's no need to pop src in order; any
+//array of elements will do, heap or not. 
+#define heap_merge(dst, src, n_src, n, cmp) \
+	__heap_insert_n(dst, src, sizeof(*(dst)), n_src, n, cmp)
+
+#define vector_heap_merge(dst, src, cmp) \
+	vector_heap_insert_n(dst, src, src##_len, cmp)
+#endif
+
+//Equivalent to inserting elem and then popping the smallest element into
+//elem_dest, but only does (at most) one pass down the heap. n is the current
+//size of the heap, which does not change. elem and elem_dest may not alias 
+//each other or point into base.
+void __heap_pushpop(
+	void *base, void const *elem, void *elem_dest, unsigned elem_sz, 
+	unsigned n, compar_fn *cmp)
+#ifdef MM_IMPLEMENT
+{
+	//If the new element would be the root, it would get popped right 
+	//away, so don't even bother putting it in the heap
+	if (n == 0 || cmp(elem, base) <= 0) {
+		memcpy(elem_dest, elem, elem_sz);
+		return;
+	}
+	
+	memcpy(elem_dest, base, elem_sz);
+	bubble_upwards(base, elem, elem_sz, 0, n, cmp);
+}
+#else
+;
+#define heap_pushpop(h, e, e_dest, n, cmp) \
+	__heap_pushpop(h, e, e_dest, sizeof(*(h)), n, cmp)
+
+#define vector_heap_pushpop(v, e, e_dest, cmp) \
+	__heap_pushpop(v, e, e_dest, sizeof(*(v)), v##_len, cmp)
+#endif
+
+//Equivalent to popping the smallest element into elem_dest and then 
+//inserting elem. Unlike __heap_pushpop, the old root is always removed
+//(even if elem is smaller). elem_dest can be NULL if you don't care about
+//the old root. n is the current size of the heap, which does not change. 
+//elem and elem_dest may not alias each other or point into base.
+void __heap_replace_top(
+	void *base, void const *elem, void *elem_dest, unsigned elem_sz, 
+	unsigned n, compar_fn *cmp)
+#ifdef MM_IMPLEMENT
+{
+	if (n == 0) {
+		FAST_FAIL("Error, replacing top of empty heap");
+	}
+	
+	if (elem_dest) memcpy(elem_dest, base, elem_sz);
+	bubble_upwards(base, elem, elem_sz, 0, n, cmp);
+}
+#else
+;
+#define heap_replace_top(h, e, e_dest, n, cmp) \
+	__heap_replace_top(h, e, e_dest, sizeof(*(h)), n, cmp)
+
+#define vector_heap_replace_top(v, e, e_dest, cmp) \
+	__heap_replace_top(v, e, e_dest, sizeof(*(v)), v##_len, cmp)
+#endif
 
 #endif
@@ -0,0 +1,260 @@
+#ifdef MM_IMPLEMENT
+	#ifndef INTERN_H_IMPLEMENTED
+		#define INTERN_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef INTERN_H
+		#define INTERN_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "intern.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "map.h" //For map_hash64
+#include "arena.h"
+#include "fast_fail.h"
+
+//A string interning table. Every distinct string is stored exactly once
+//(in an arena), and gets a small integer ID handed out in order: 0, 1, 2,
+//and so on. Once strings are interned, comparing them is comparing IDs (or
+//canonical pointers) instead of calling strcmp. IDs also make good keys
+//for VAL2x maps: hashing a uint32_t is a lot cheaper than hashing a string.
+//
+//Any number of threads can use the table at once. Looking up a string
+//that's already interned takes no locks at all: the hash table is
+//published with atomic pointers, and a reader just probes whatever table
+//is current. Adding a new string takes a mutex. When the table grows, the
+//old one can't be freed right away (a reader might still be in it), so it
+//hangs around until intern_free.
+//
+//  intern_table t;
+//  intern_init(&t);
+//  uint32_t get = intern_id(&t, "GET");
+//  char const *p = intern(&t, "GET");
+//  ...
+//  if (intern_lookup(&t, method) == get) ...   //No strcmp
+//  intern_free(&t);
+
+#ifndef MM_IMPLEMENT
+#define INTERN_NONE ((uint32_t) -1)
+
+//IDs are turned into strings with a two-level array that never moves, so
+//intern_str doesn't need any locking either
+#define INTERN_PAGE_BITS 12
+#define INTERN_PAGE_SZ (1u << INTERN_PAGE_BITS)
+#define INTERN_MAX_PAGES 4096 //So at most 16M strings
+
+#define INTERN_INIT_SZ 64
+
+typedef struct __intern_tab {
+    uint32_t mask;
+    struct __intern_tab *prev; //Older (retired) tables
+    //Each slot is (hash << 32) | (id + 1), or 0 if empty. Packing both
+    //into one word means a single atomic store publishes a slot.
+    _Atomic uint64_t slots[];
+} __intern_tab;
+
+typedef struct {
+    __intern_tab *_Atomic tab;
+    char const ***pages;
+    arena strings;
+    _Atomic uint32_t count;
+    pthread_mutex_t lock; //Only for adding strings
+} intern_table;
+
+//Number of strings interned so far (which is also the next ID)
+#define intern_count(t) atomic_load_explicit(&(t)->count, memory_order_acquire)
+#endif
+
+#ifdef MM_IMPLEMENT
+static uint32_t __intern_hash(char const *s) {
+    uint64_t h = map_hash64(s, strlen(s), 0);
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+static __intern_tab *__intern_new_tab(uint32_t sz) {
+    __intern_tab *tab = calloc(1, sizeof(__intern_tab) + sz*sizeof(uint64_t));
+    if (!tab) FAST_FAIL("out of memory");
+    tab->mask = sz - 1;
+    return tab;
+}
+
+#define __intern_get(t, id) \
+    ((t)->pages[(id) >> INTERN_PAGE_BITS][(id) & (INTERN_PAGE_SZ - 1)])
+
+//The lock-free part. Returns the ID, or INTERN_NONE
+static uint32_t __intern_find(
+    intern_table const *t, __intern_tab *tab,
+    char const *s, uint32_t hash
+) {
+    uint32_t i = hash & tab->mask;
+    while (1) {
+        //Acquire pairs with the release in __intern_put, so if we see the
+        //slot, we also see the string it points to
+        uint64_t e = atomic_load_explicit(&tab->slots[i], memory_order_acquire);
+        if (e == 0) return INTERN_NONE;
+
+        if ((uint32_t) (e >> 32) == hash) {
+            uint32_t id = (uint32_t) e - 1;
+            if (!strcmp(__intern_get(t, id), s)) return id;
+        }
+        i = (i + 1) & tab->mask;
+    }
+}
+
+//Lock must be held. The key must not already be in tab.
+static void __intern_put(__intern_tab *tab, uint32_t hash, uint32_t id) {
+    uint32_t i = hash & tab->mask;
+    while (atomic_load_explicit(&tab->slots[i], memory_order_relaxed) != 0) {
+        i = (i + 1) & tab->mask;
+    }
+    uint64_t e = ((uint64_t) hash << 32) | (id + 1);
+    atomic_store_explicit(&tab->slots[i], e, memory_order_release);
+}
+#endif
+
+void intern_init(intern_table *t)
+#ifdef MM_IMPLEMENT
+{
+    atomic_init(&t->tab, __intern_new_tab(INTERN_INIT_SZ));
+    t->pages = calloc(INTERN_MAX_PAGES, sizeof(char const **));
+    if (!t->pages) FAST_FAIL("out of memory");
+    arena_init(&t->strings);
+    atomic_init(&t->count, 0);
+    pthread_mutex_init(&t->lock, NULL);
+}
+#else
+;
+#endif
+
+//Frees everything, including all the strings. Nobody can be using the
+//table anymore.
+void intern_free(intern_table *t)
+#ifdef MM_IMPLEMENT
+{
+    __intern_tab *tab = atomic_load(&t->tab);
+    while (tab) {
+        __intern_tab *prev = tab->prev;
+        free(tab);
+        tab = prev;
+    }
+
+    uint32_t p;
+    for (p = 0; p < INTERN_MAX_PAGES; p++) free(t->pages[p]);
+    free(t->pages);
+
+    arena_free(&t->strings);
+    pthread_mutex_destroy(&t->lock);
+}
+#else
+;
+#endif
+
+//Returns the ID of s if it's already interned, or INTERN_NONE. Never
+//takes a lock.
+uint32_t intern_lookup(intern_table const *t, char const *s)
+#ifdef MM_IMPLEMENT
+{
+    __intern_tab *tab = atomic_load_explicit(&((intern_table *) t)->tab, memory_order_acquire);
+    return __intern_find(t, tab, s, __intern_hash(s));
+}
+#else
+;
+#endif
+
+//Returns the ID of s, interning it first if needed. Only takes the lock if
+//s is new.
+uint32_t intern_id(intern_table *t, char const *s)
+#ifdef MM_IMPLEMENT
+{
+    uint32_t hash = __intern_hash(s);
+    __intern_tab *tab = atomic_load_explicit(&t->tab, memory_order_acquire);
+    uint32_t id = __intern_find(t, tab, s, hash);
+    if (id != INTERN_NONE) return id;
+
+    pthread_mutex_lock(&t->lock);
+
+    //Someone might have added it (or grown the table) while we were
+    //waiting for the lock
+    tab = atomic_load_explicit(&t->tab, memory_order_relaxed);
+    id = __intern_find(t, tab, s, hash);
+    if (id != INTERN_NONE) {
+        pthread_mutex_unlock(&t->lock);
+        return id;
+    }
+
+    id = atomic_load_explicit(&t->count, memory_order_relaxed);
+    uint32_t page = id >> INTERN_PAGE_BITS;
+    if (page >= INTERN_MAX_PAGES) FAST_FAIL("too many interned strings");
+    if (!t->pages[page]) {
+        t->pages[page] = malloc(INTERN_PAGE_SZ * sizeof(char const *));
+        if (!t->pages[page]) FAST_FAIL("out of memory");
+    }
+    __intern_get(t, id) = arena_strdup(&t->strings, s);
+
+    //Keep the table at most half full. Readers may still be looking at
+    //the old table, so it goes on the retired list instead of being freed.
+    if ((uint64_t) (id + 1) * 2 > tab->mask + 1) {
+        __intern_tab *bigger = __intern_new_tab((tab->mask + 1) * 2);
+        uint32_t i;
+        for (i = 0; i <= tab->mask; i++) {
+            uint64_t e = atomic_load_explicit(&tab->slots[i], memory_order_relaxed);
+            if (e) __intern_put(bigger, (uint32_t) (e >> 32), (uint32_t) e - 1);
+        }
+        bigger->prev = tab;
+        atomic_store_explicit(&t->tab, bigger, memory_order_release);
+        tab = bigger;
+    }
+
+    __intern_put(tab, hash, id);
+    atomic_store_explicit(&t->count, id + 1, memory_order_release);
+
+    pthread_mutex_unlock(&t->lock);
+    return id;
+}
+#else
+;
+#endif
+
+//Turns an ID back into its (canonical) string. Never takes a lock.
+char const *intern_str(intern_table const *t, uint32_t id)
+#ifdef MM_IMPLEMENT
+{
+    return __intern_get(t, id);
+}
+#else
+;
+#endif
+
+//Returns the canonical copy of s, interning it first if needed. Two
+//strings are equal if and only if intern gives the same pointer for both.
+char const *intern(intern_table *t, char const *s)
+#ifdef MM_IMPLEMENT
+{
+    return intern_str(t, intern_id(t, s));
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
@@ -46,8 +46,237 @@ static inline void list_del(list_head *node) {
 }
 
 #define container_of(node, type, member) \
-    (type*)(((void*)(node)) - offsetof(type,member))
+    ((type*)(((void*)(node)) - offsetof(type,member)))
 
 #define list_empty(node) ((node)->next == (node))
 
+//Moves every node in list to right after before. list is left empty.
+static inline void list_splice(list_head *before, list_head *list) {
+    if (list_empty(list)) return;
+
+    list_head *first = list->next;
+    list_head *last = list->prev;
+    list_head *after = before->next;
+
+    before->next = first;
+    first->prev = before;
+    last->next = after;
+    after->prev = last;
+
+    init_list_head(list);
+}
+
+//Moves every node in list to right before after. list is left empty. (In 
+//other words, if after is the head of a list, this appends to the tail)
+static inline void list_splice_before(list_head *after, list_head *list) {
+    list_splice(after->prev, list);
+}
+
+//Moves the nodes from the start of head up to and including node into 
+//list, which should be empty (anything in it is lost). If node is head 
+//itself, list ends up empty.
+static inline void list_cut_position(list_head *list, list_head *head, list_head *node) {
+    init_list_head(list);
+    if (list_empty(head) || node == head) return;
+
+    list_head *first = head->next;
+    list_head *rest = node->next;
+
+    list->next = first;
+    first->prev = list;
+    list->prev = node;
+    node->next = list;
+
+    head->next = rest;
+    rest->prev = head;
+}
+
+//Same convention as qsort: negative means a goes before b
+typedef int list_cmp_fn(list_head const *a, list_head const *b);
+
+//Merges two NULL-terminated lists (linked only through next), keeping
+//equal elements in their original order.
+static inline list_head *__list_merge(list_cmp_fn *cmp, list_head *a, list_head *b) {
+    list_head *ret;
+    list_head **tail = &ret;
+
+    while (1) {
+        if (cmp(a, b) <= 0) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
+                break;
+            }
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+//Last merge of list_sort. Same as __list_merge, but also fixes up the prev
+//pointers and hooks everything back onto head.
+static inline void __list_merge_final(list_cmp_fn *cmp, list_head *head, list_head *a, list_head *b) {
+    list_head *tail = head;
+
+    while (a && b) {
+        if (cmp(a, b) <= 0) {
+            tail->next = a;
+            a->prev = tail;
+            tail = a;
+            a = a->next;
+        } else {
+            tail->next = b;
+            b->prev = tail;
+            tail = b;
+            b = b->next;
+        }
+    }
+
+    list_head *rest = a ? a : b;
+    while (rest) {
+        tail->next = rest;
+        rest->prev = tail;
+        tail = rest;
+        rest = rest->next;
+    }
+
+    tail->next = head;
+    head->prev = tail;
+}
+
+//Stable merge sort, O(n log n) compares, no extra memory. This is the one
+//from the Linux kernel (lib/list_sort.c). Rather than the usual top-down
+//recursion, it reads the list front to back and keeps a stack of sorted 
+//runs whose sizes are powers of two, threaded through the (otherwise 
+//unused) prev pointers. The bits of count tell us when two runs of the same 
+//size are on top of the stack and need to be merged. Merges are always 
+//between runs of at most 2:1 size, and the whole thing is pretty cache 
+//friendly since it mostly works on the recently-touched end of the list.
+static inline void list_sort(list_head *head, list_cmp_fn *cmp) {
+    list_head *list = head->next;
+    list_head *pending = NULL;
+    unsigned long count = 0;
+
+    if (list == head->prev) return; //Zero or one elements
+
+    //Convert to a NULL-terminated singly linked list
+    head->prev->next = NULL;
+
+    do {
+        unsigned long bits;
+        list_head **tail = &pending;
+
+        //Find the least-significant clear bit in count
+        for (bits = count; bits & 1; bits >>= 1) {
+            tail = &(*tail)->prev;
+        }
+
+        //Do the indicated merge (unless count+1 is a power of two)
+        if (bits) {
+            list_head *a = *tail;
+            list_head *b = a->prev;
+
+            a = __list_merge(cmp, b, a);
+            a->prev = b->prev;
+            *tail = a;
+        }
+
+        //Move one element from the input onto the pending stack
+        list->prev = pending;
+        pending = list;
+        list = list->next;
+        pending->next = NULL;
+        count++;
+    } while (list);
+
+    //Merge everything that's left on the stack
+    list = pending;
+    pending = pending->prev;
+    while (1) {
+        list_head *next = pending->prev;
+        if (!next) break;
+        list = __list_merge(cmp, pending, list);
+        pending = next;
+    }
+
+    __list_merge_final(cmp, head, pending, list);
+}
+
+//Also stolen from the kernel: lists with a single-pointer head. These are 
+//meant for hash table buckets, where you have a big array of heads that 
+//are almost always empty and never need to get to the tail. The head is
+//half the size of a list_head, so you get twice as many buckets per cache
+//line. The trick is that pprev points at whatever pointer points to us
+//(either the head's first pointer or the previous node's next pointer), 
+//so we can still delete in O(1) without knowing which bucket we're in.
+
+typedef struct hlist_node {
+    struct hlist_node *next, **pprev;
+} hlist_node;
+
+typedef struct hlist_head {
+    hlist_node *first;
+} hlist_head;
+
+#define HLIST_HEAD_INIT {NULL}
+
+static inline void init_hlist_head(hlist_head *head) {
+    head->first = NULL;
+}
+
+static inline void init_hlist_node(hlist_node *node) {
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+#define hlist_empty(head) ((head)->first == NULL)
+
+//True if node isn't in any list (assuming it was initialized or deleted
+//with hlist_del_init)
+#define hlist_unhashed(node) ((node)->pprev == NULL)
+
+static inline void hlist_add_head(hlist_head *head, hlist_node *node) {
+    hlist_node *first = head->first;
+    node->next = first;
+    if (first) first->pprev = &node->next;
+    head->first = node;
+    node->pprev = &head->first;
+}
+
+static inline void hlist_add_before(hlist_node *after, hlist_node *node) {
+    node->pprev = after->pprev;
+    node->next = after;
+    after->pprev = &node->next;
+    *(node->pprev) = node;
+}
+
+static inline void hlist_add_behind(hlist_node *before, hlist_node *node) {
+    node->next = before->next;
+    before->next = node;
+    node->pprev = &before->next;
+    if (node->next) node->next->pprev = &node->next;
+}
+
+static inline void hlist_del(hlist_node *node) {
+    hlist_node *next = node->next;
+    *(node->pprev) = next;
+    if (next) next->pprev = node->pprev;
+}
+
+static inline void hlist_del_init(hlist_node *node) {
+    if (hlist_unhashed(node)) return;
+    hlist_del(node);
+    init_hlist_node(node);
+}
+
 #endif
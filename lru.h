@@ -0,0 +1,413 @@
+#ifdef MM_IMPLEMENT
+	#ifndef LRU_H_IMPLEMENTED
+		#define LRU_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef LRU_H
+		#define LRU_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "lru.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "list.h"
+#include "map.h"
+#include "fast_fail.h"
+
+//An LRU cache where the cache doesn't own anything. You put an lru_node in
+//your own struct (same idea as list_head), and the cache just keeps track of
+//which ones were used recently. Lookups go through a map.h map from your key
+//to the lru_node, and recency is a list_head list, so get/put/touch are all
+//O(1).
+//
+//The capacity is in bytes (or whatever unit you like; the cache just adds
+//up the sizes you give it). When a put pushes the total over capacity, the
+//least recently used nodes are unlinked from the cache and handed to your
+//eviction callback all at once, as a list threaded through node->recency.
+//
+//Keys follow the same rules as map.h: for a value-typed key, pass a pointer
+//to it; for a pointer or string key, pass the pointer itself. The cache
+//holds on to the key pointer you give to lru_put (it never copies or frees
+//keys), so point it at something inside your struct.
+//
+//Example:
+//
+//  struct page {
+//      char *url;
+//      char *body;
+//      lru_node node;
+//  };
+//
+//  void free_pages(list_head *evicted, void *arg) {
+//      while (!list_empty(evicted)) {
+//          list_head *l = evicted->next;
+//          list_del(l);
+//          struct page *p = container_of(l, struct page, node.recency);
+//          free(p->url);
+//          free(p->body);
+//          free(p);
+//      }
+//  }
+//
+//  lru_cache c;
+//  lru_init(&c, char*, STR2PTR, 1<<20, free_pages, NULL);
+//  ...
+//  lru_put(&c, p->url, &p->node, strlen(p->body));
+//  ...
+//  lru_node *n = lru_get(&c, "https://example.com");
+//  if (n) serve(container_of(n, struct page, node));
+
+#ifndef MM_IMPLEMENT
+typedef struct lru_node {
+    list_head recency;
+    void const *key; //Exactly as it was given to lru_put
+    size_t bytes;
+} lru_node;
+
+//evicted is a list of lru_nodes (linked through their recency members) that
+//have already been removed from the cache. The callback owns them now.
+typedef void lru_evict_fn(list_head *evicted, void *arg);
+
+typedef struct {
+    map m; //key -> lru_node*
+    list_head recency; //Most recently used at the front
+    size_t bytes;
+    size_t capacity;
+    lru_evict_fn *evict;
+    void *evict_arg;
+} lru_cache;
+
+//x is one of the map.h presets with a PTR value (VAL2PTR, PTR2PTR or
+//STR2PTR), since the map stores a pointer to your lru_node. evict may be
+//NULL if you have some other way to find out about evictions.
+//(Calls map_custom_init directly because x has already been expanded into
+//a bunch of comma-separated arguments by the time we get to use it)
+#define lru_init(c, ktype, x, cap, evict_fn, arg)            \
+do {                                                         \
+    map_custom_init(&(c)->m, ktype, lru_node*, x);           \
+    init_list_head(&(c)->recency);                           \
+    (c)->bytes = 0;                                          \
+    (c)->capacity = cap;                                     \
+    (c)->evict = evict_fn;                                   \
+    (c)->evict_arg = arg;                                    \
+} while(0)
+
+#define lru_empty(c) list_empty(&(c)->recency)
+
+//Least recently used node (the next one to be evicted), or NULL
+#define lru_oldest(c) \
+    (lru_empty(c) ? NULL : container_of((c)->recency.prev, lru_node, recency))
+#endif
+
+#ifdef MM_IMPLEMENT
+//Unlinks a node from the cache. Does not call the eviction callback.
+static void lru_unlink(lru_cache *c, lru_node *node) {
+    map_search_delete(&c->m, node->key, NULL);
+    list_del(&node->recency);
+    c->bytes -= node->bytes;
+}
+
+//Evicts from the tail until we're under capacity, but never evicts keep.
+//Everything evicted is handed to the callback in one batch.
+static void lru_shrink(lru_cache *c, lru_node *keep, list_head *evicted) {
+    while (c->bytes > c->capacity) {
+        lru_node *victim = container_of(c->recency.prev, lru_node, recency);
+        if (victim == keep) break;
+        lru_unlink(c, victim);
+        list_add_before(evicted, &victim->recency);
+    }
+}
+#endif
+
+//Looks up a key without changing its recency. Returns NULL if not found.
+lru_node *lru_peek(lru_cache const *c, void const *key)
+#ifdef MM_IMPLEMENT
+{
+    lru_node **found = map_search(&c->m, key);
+    return found ? *found : NULL;
+}
+#else
+;
+#endif
+
+//Marks a node as the most recently used
+void lru_touch(lru_cache *c, lru_node *node)
+#ifdef MM_IMPLEMENT
+{
+    list_del(&node->recency);
+    list_add(&c->recency, &node->recency);
+}
+#else
+;
+#endif
+
+//Looks up a key and marks it as the most recently used. Returns NULL if
+//not found.
+lru_node *lru_get(lru_cache *c, void const *key)
+#ifdef MM_IMPLEMENT
+{
+    lru_node *node = lru_peek(c, key);
+    if (node) lru_touch(c, node);
+    return node;
+}
+#else
+;
+#endif
+
+#ifdef MM_IMPLEMENT
+//Does all the work of lru_put, but leaves the evicted nodes in evicted 
+//instead of calling the callback
+static void lru_put_collect(
+    lru_cache *c, 
+    void const *key, lru_node *node, size_t bytes,
+    list_head *evicted
+) {
+    lru_node *old = lru_peek(c, key);
+    if (old) {
+        lru_unlink(c, old);
+        //Putting the same node twice just updates its size
+        if (old != node) list_add_before(evicted, &old->recency);
+    }
+
+    node->key = key;
+    node->bytes = bytes;
+    map_insert(&c->m, key, 0, node, 0);
+    list_add(&c->recency, &node->recency);
+    c->bytes += bytes;
+
+    lru_shrink(c, node, evicted);
+}
+#endif
+
+//Adds node to the cache as the most recently used entry, with the given
+//size. If the key was already in the cache, the old node is replaced and
+//goes to the eviction callback along with anything that got pushed out for
+//being over capacity. The node just added is never evicted by this call
+//(even if it is bigger than the whole cache on its own).
+void lru_put(lru_cache *c, void const *key, lru_node *node, size_t bytes)
+#ifdef MM_IMPLEMENT
+{
+    list_head evicted = LIST_HEAD_INIT(evicted);
+
+    lru_put_collect(c, key, node, bytes, &evicted);
+
+    if (!list_empty(&evicted) && c->evict) {
+        c->evict(&evicted, c->evict_arg);
+    }
+}
+#else
+;
+#endif
+
+//Takes a node out of the cache without calling the eviction callback
+void lru_remove(lru_cache *c, lru_node *node)
+#ifdef MM_IMPLEMENT
+{
+    lru_unlink(c, node);
+}
+#else
+;
+#endif
+
+//Changes the capacity, evicting (in one batch) if we're now over it
+void lru_set_capacity(lru_cache *c, size_t capacity)
+#ifdef MM_IMPLEMENT
+{
+    list_head evicted = LIST_HEAD_INIT(evicted);
+
+    c->capacity = capacity;
+    lru_shrink(c, NULL, &evicted);
+
+    if (!list_empty(&evicted) && c->evict) {
+        c->evict(&evicted, c->evict_arg);
+    }
+}
+#else
+;
+#endif
+
+//Hands every node still in the cache to the eviction callback (as one
+//batch), then frees the cache's own memory.
+void lru_free(lru_cache *c)
+#ifdef MM_IMPLEMENT
+{
+    map_free(&c->m);
+
+    if (!list_empty(&c->recency) && c->evict) {
+        list_head all = LIST_HEAD_INIT(all);
+        list_splice(&all, &c->recency);
+        c->evict(&all, c->evict_arg);
+    }
+    init_list_head(&c->recency);
+    c->bytes = 0;
+}
+#else
+;
+#endif
+
+//Sharded version for sharing one cache between threads. Each shard is a
+//completely separate lru_cache with its own lock and 1/nshards of the
+//capacity, and keys are spread over the shards by hash. Eviction callbacks
+//are called after the shard's lock is released.
+//
+//Since another thread can evict a node the moment we unlock its shard,
+//lookups don't return the node; instead you give a function that gets
+//called on the node while the lock is still held (e.g. to copy something
+//out or bump a refcount).
+#ifndef MM_IMPLEMENT
+typedef void lru_visit_fn(lru_node *node, void *arg);
+
+typedef struct {
+    pthread_mutex_t lock;
+    lru_cache c;
+    //Don't want two shards' locks on the same cache line
+    char pad[64];
+} lru_shard;
+
+typedef struct {
+    unsigned nshards; //Always a power of two
+    unsigned shard_bits;
+    lru_shard *shards;
+} lru_sharded;
+
+//nshards gets rounded up to a power of two
+#define lru_sharded_init(s, nshards_want, ktype, x, cap, evict_fn, arg)   \
+do {                                                                     \
+    unsigned __lru_bits = 0;                                             \
+    while ((1u << __lru_bits) < (nshards_want)) __lru_bits++;            \
+    (s)->shard_bits = __lru_bits;                                        \
+    (s)->nshards = 1u << __lru_bits;                                     \
+    (s)->shards = calloc((s)->nshards, sizeof(lru_shard));               \
+    if (!(s)->shards) FAST_FAIL("out of memory");                        \
+    unsigned __lru_i;                                                    \
+    for (__lru_i = 0; __lru_i < (s)->nshards; __lru_i++) {               \
+        lru_shard *__sh = (s)->shards + __lru_i;                         \
+        pthread_mutex_init(&__sh->lock, NULL);                           \
+        map_custom_init(&__sh->c.m, ktype, lru_node*, x);                \
+        init_list_head(&__sh->c.recency);                                \
+        __sh->c.bytes = 0;                                               \
+        __sh->c.capacity = ((cap) + (s)->nshards - 1) / (s)->nshards;    \
+        __sh->c.evict = evict_fn;                                        \
+        __sh->c.evict_arg = arg;                                         \
+    }                                                                    \
+} while(0)
+#endif
+
+#ifdef MM_IMPLEMENT
+static lru_shard *lru_shard_for(lru_sharded *s, void const *key) {
+    if (s->nshards == 1) return s->shards;
+
+    //All the shards' maps use the same hash function, so just borrow the
+    //first one. See the big comment in map.h about key_is_ptr.
+    map const *md = &s->shards[0].c.m;
+    void const *pk = md->key_is_ptr ? &key : key;
+    uint32_t h = md->hash(pk, md->key_sz);
+
+    //The maps inside the shards take the top bits of a Fibonacci multiply
+    //(see __map_idx), so if we did the same thing here every key in a 
+    //shard would land in the same part of its map. Run the hash through a
+    //different mixer (murmur3's finalizer) and use the low bits instead.
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return s->shards + (h & (s->nshards - 1));
+}
+#endif
+
+//Returns 1 if the key was found (in which case visit was called on it, if
+//not NULL), or 0 if not. Marks the node as most recently used.
+int lru_sharded_get(lru_sharded *s, void const *key, lru_visit_fn *visit, void *arg)
+#ifdef MM_IMPLEMENT
+{
+    lru_shard *sh = lru_shard_for(s, key);
+
+    pthread_mutex_lock(&sh->lock);
+    lru_node *node = lru_get(&sh->c, key);
+    if (node && visit) visit(node, arg);
+    pthread_mutex_unlock(&sh->lock);
+
+    return node != NULL;
+}
+#else
+;
+#endif
+
+void lru_sharded_put(lru_sharded *s, void const *key, lru_node *node, size_t bytes)
+#ifdef MM_IMPLEMENT
+{
+    lru_shard *sh = lru_shard_for(s, key);
+
+    list_head evicted = LIST_HEAD_INIT(evicted);
+
+    pthread_mutex_lock(&sh->lock);
+    lru_put_collect(&sh->c, key, node, bytes, &evicted);
+    pthread_mutex_unlock(&sh->lock);
+
+    if (!list_empty(&evicted) && sh->c.evict) {
+        sh->c.evict(&evicted, sh->c.evict_arg);
+    }
+}
+#else
+;
+#endif
+
+//Returns 1 if the key was removed (without calling the eviction callback;
+//visit is called on the node first, if not NULL) or 0 if it wasn't found
+int lru_sharded_remove(lru_sharded *s, void const *key, lru_visit_fn *visit, void *arg)
+#ifdef MM_IMPLEMENT
+{
+    lru_shard *sh = lru_shard_for(s, key);
+
+    pthread_mutex_lock(&sh->lock);
+    lru_node *node = lru_peek(&sh->c, key);
+    if (node) {
+        lru_unlink(&sh->c, node);
+        if (visit) visit(node, arg);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    return node != NULL;
+}
+#else
+;
+#endif
+
+//Not thread-safe. Everything left goes to the eviction callback.
+void lru_sharded_free(lru_sharded *s)
+#ifdef MM_IMPLEMENT
+{
+    unsigned i;
+    for (i = 0; i < s->nshards; i++) {
+        lru_free(&s->shards[i].c);
+        pthread_mutex_destroy(&s->shards[i].lock);
+    }
+    free(s->shards);
+    s->shards = NULL;
+    s->nshards = 0;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
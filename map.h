@@ -29,6 +29,7 @@
 #include <stddef.h>
 #include <string.h>
 #include "list.h"
+#include "arena.h"
 #include "fast_fail.h"
 
 #ifndef MM_IMPLEMENT
@@ -82,6 +83,151 @@ uint32_t map_str_hash(void const *a, unsigned sz)
 ;
 #endif
 
+#ifdef MM_IMPLEMENT
+//This is wyhash (https://github.com/wangyi-fudan/wyhash), which I picked
+//because it's tiny, it's about as fast as anything out there, and it passes
+//SMHasher. Instead of one byte per iteration it eats 16 bytes at a time 
+//(48 for long keys), and everything is mixed with a 64x64 -> 128 multiply.
+//Unaligned reads go through memcpy, which compilers turn into plain loads.
+static uint64_t const map_wyp[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+//Multiplies a and b and puts the low and high halves of the result back
+//into a and b
+static inline void map_wymum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t) *a * *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+#else
+    //Schoolbook multiplication on 32 bit halves
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static inline uint64_t map_wymix(uint64_t a, uint64_t b) {
+    map_wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t map_wyr8(uint8_t const *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t map_wyr4(uint8_t const *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+//Reads 1 to 3 bytes
+static inline uint64_t map_wyr3(uint8_t const *p, size_t k) {
+    return (((uint64_t) p[0]) << 16) | (((uint64_t) p[k >> 1]) << 8) | p[k - 1];
+}
+#endif
+
+//General-purpose 64 bit hash of len bytes. Different seeds give unrelated
+//hash functions.
+uint64_t map_hash64(void const *key, size_t len, uint64_t seed)
+#ifdef MM_IMPLEMENT
+{
+    uint8_t const *p = (uint8_t const *) key;
+    uint64_t const *s = map_wyp;
+    uint64_t a, b;
+
+    seed ^= map_wymix(seed ^ s[0], s[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            //Two (possibly overlapping) pairs of 4 byte reads cover 
+            //everything from 4 to 16 bytes without any loops
+            a = (map_wyr4(p) << 32) | map_wyr4(p + ((len >> 3) << 2));
+            b = (map_wyr4(p + len - 4) << 32) | map_wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = map_wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i >= 48) {
+            //Three independent lanes so the multiplies can overlap
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = map_wymix(map_wyr8(p) ^ s[1], map_wyr8(p + 8) ^ seed);
+                see1 = map_wymix(map_wyr8(p + 16) ^ s[2], map_wyr8(p + 24) ^ see1);
+                see2 = map_wymix(map_wyr8(p + 32) ^ s[3], map_wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = map_wymix(map_wyr8(p) ^ s[1], map_wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        //Last 16 bytes (which may overlap with the ones we just did)
+        a = map_wyr8(p + i - 16);
+        b = map_wyr8(p + i - 8);
+    }
+
+    a ^= s[1];
+    b ^= seed;
+    map_wymum(&a, &b);
+    return map_wymix(a ^ s[0] ^ len, b ^ s[1]);
+}
+#else
+;
+#endif
+
+//Drop-in replacements for map_val_hash, map_ptr_hash and map_str_hash that
+//use map_hash64. The map only needs 32 bits, so the two halves are folded 
+//together (which keeps the good mixing in both the high and low bits).
+uint32_t map_val_wyhash(void const *a, unsigned sz)
+#ifdef MM_IMPLEMENT
+{
+    uint64_t h = map_hash64(a, sz, 0);
+    return (uint32_t) (h ^ (h >> 32));
+}
+#else
+;
+#endif
+uint32_t map_ptr_wyhash(void const *a, unsigned sz)
+#ifdef MM_IMPLEMENT
+{
+    return map_val_wyhash(*(void const**)a, sz);
+}
+#else
+;
+#endif
+uint32_t map_str_wyhash(void const *a, unsigned sz)
+#ifdef MM_IMPLEMENT
+{
+    (void) sz; //Strings know their own length
+    char const *str = *(char const **) a;
+    if (!str) return 0;
+
+    uint64_t h = map_hash64(str, strlen(str), 0);
+    return (uint32_t) (h ^ (h >> 32));
+}
+#else
+;
+#endif
+
 #ifndef MM_IMPLEMENT
 typedef int map_comp_fn(void const *, void const *, unsigned);
 #endif
@@ -146,12 +292,28 @@ typedef struct {
 } __entry_flags;
 
 typedef struct {
-    uint32_t slots; //Does not include sentinel
+    uint32_t slots; //Does not include sentinel. Always a power of two
+    unsigned slot_bits; //slots == 1 << slot_bits
+
+    //Incremental resizing (see map_set_incremental). While a resize is
+    //in progress, the previous table hangs around in old_entries and a
+    //few of its entries get moved over on every insert and delete. The
+    //rest of the time, old_entries is NULL.
+    unsigned rehash_step; //0 means resize all at once (the default)
+    void *old_entries;
+    unsigned old_slot_bits;
+
+    uint32_t count; //Number of entries in the map (both tables)
 
     //Could have kept head of list of full nodes here,
     //but the sentinel already has space for it (and 
     //we get a benefit when it comes to managing flags).
     list_head empties; //Linked list of empty nodes
+    //Every slot from here to the end of the table has never been used 
+    //(and so isn't in empties either). We hand these out before going to 
+    //the empties list, which means a resize doesn't have to touch every 
+    //slot of the new table just to build a free list
+    uint32_t fresh;
     //OTOH, I didn't want to put both lists into the
     //sentinel because I don't want the size of the 
     //sentinel to be bigger than the size of a record
@@ -245,31 +407,51 @@ typedef struct {
     //lose some optimizations
     unsigned list_head_off;
     unsigned flag_off;
+    unsigned hash_off;
     unsigned key_off;
     unsigned key_sz;
     unsigned val_off;
     unsigned val_sz;
+
+    //Optional reverse index from values to keys, for finding entries by
+    //value without looking at every single one (see 
+    //map_enable_value_index). vindex is NULL unless it's turned on.
+    map_hash_fn *val_hash;
+    hlist_head *vindex;
+    unsigned vindex_bits;
+    uint32_t vindex_count;
+
+    //If not NULL, the map copies every pointer/string key and value into
+    //this arena and frees them all at once (see map_use_arena)
+    arena *arena;
 } map;
 
+//The cached hash fits in the padding after the flags (on 64 bit machines,
+//anyway) so it's basically free. It saves us from calling the hash function
+//again whenever entries get moved around, and lets us skip almost all of
+//the key_comp calls when walking a bucket.
 #define MAP_STRUCT(ktype, vtype) \
 struct {                         \
     list_head entry_list;        \
     __entry_flags flags;         \
+    uint32_t hash;               \
     ktype key;                   \
     vtype val;                   \
 }
 
 
-//Some helpers to make map_init a little friendlier
-#define VAL2VAL map_val_hash,map_val_comp,map_val_comp,map_val_free,map_val_free,sizeof(entries->key),sizeof(entries->val)
-#define VAL2PTR map_val_hash,map_val_comp,map_ptr_comp,map_val_free,map_ptr_free,sizeof(entries->key),sizeof(*entries->val)
-#define VAL2STR map_val_hash,map_val_comp,map_str_comp,map_val_free,map_str_free,sizeof(entries->key),0
-#define PTR2VAL map_ptr_hash,map_ptr_comp,map_val_comp,map_ptr_free,map_val_free,sizeof(*entries->key),sizeof(entries->val)
-#define PTR2PTR map_ptr_hash,map_ptr_comp,map_ptr_comp,map_ptr_free,map_ptr_free,sizeof(*entries->key),sizeof(*entries->val)
-#define PTR2STR map_ptr_hash,map_ptr_comp,map_str_comp,map_ptr_free,map_str_free,sizeof(*entries->key),0
-#define STR2VAL map_str_hash,map_str_comp,map_val_comp,map_str_free,map_val_free,0,sizeof(entries->val)
-#define STR2PTR map_str_hash,map_str_comp,map_ptr_comp,map_str_free,map_ptr_free,0,sizeof(*entries->val)
-#define STR2STR map_str_hash,map_str_comp,map_str_comp,map_str_free,map_str_free,0,0
+//Some helpers to make map_init a little friendlier. These all use the wyhash
+//functions; the old byte-at-a-time hashes are still there if you want them,
+//but you'll have to call map_custom_init yourself.
+#define VAL2VAL map_val_wyhash,map_val_comp,map_val_comp,map_val_free,map_val_free,sizeof(entries->key),sizeof(entries->val)
+#define VAL2PTR map_val_wyhash,map_val_comp,map_ptr_comp,map_val_free,map_ptr_free,sizeof(entries->key),sizeof(*entries->val)
+#define VAL2STR map_val_wyhash,map_val_comp,map_str_comp,map_val_free,map_str_free,sizeof(entries->key),0
+#define PTR2VAL map_ptr_wyhash,map_ptr_comp,map_val_comp,map_ptr_free,map_val_free,sizeof(*entries->key),sizeof(entries->val)
+#define PTR2PTR map_ptr_wyhash,map_ptr_comp,map_ptr_comp,map_ptr_free,map_ptr_free,sizeof(*entries->key),sizeof(*entries->val)
+#define PTR2STR map_ptr_wyhash,map_ptr_comp,map_str_comp,map_ptr_free,map_str_free,sizeof(*entries->key),0
+#define STR2VAL map_str_wyhash,map_str_comp,map_val_comp,map_str_free,map_val_free,0,sizeof(entries->val)
+#define STR2PTR map_str_wyhash,map_str_comp,map_ptr_comp,map_str_free,map_ptr_free,0,sizeof(*entries->val)
+#define STR2STR map_str_wyhash,map_str_comp,map_str_comp,map_str_free,map_str_free,0,0
 
 //https://stackoverflow.com/questions/29962560/understanding-defer-and-obstruct-macros/30009264
 #define EMPTY()
@@ -282,53 +464,33 @@ struct {                         \
 #define anon_offsetof(ptr,member) \
     ((void*)(&(ptr)->member) - (void*)(ptr))
 
-#define MAP_INIT_SZ 4
+#define MAP_INIT_BITS 2
+#define MAP_INIT_SZ (1 << MAP_INIT_BITS)
 //Does not free existing map data. Sadly, we have the same 
 //problem as qsort that we can't type-check the given
 //function pointers (i.e. their arguments have to all be 
 //void pointers instead of pointers to the specific types).
-//Would have been nicer as a callable function to avoid this 
-//inlining penalty, so maybe I'll change that later on. The 
-//downside is that all those sizeofs and offsets need to be 
-//passed into the function, which means a lot of parameters
+//The macro only works out the sizes and offsets (which needs 
+//the types), and __map_setup does everything else. That 
+//means a lot of parameters, but it's the one place that 
+//knows how to fill in a map (set.h uses it too).
 #define map_custom_init(m,ktype,vtype,hsh,kcmp,vcmp,kfree,vfree,ksz,vsz) \
 do {                                                                     \
-    MAP_STRUCT(ktype,vtype) *entries =                                   \
-        calloc(MAP_INIT_SZ,sizeof(*entries));                            \
-    if (!entries) FAST_FAIL("out of memory");                            \
-    list_head *fulls = &entries->entry_list;                             \
-    fulls->next = fulls;                                                 \
-    fulls->prev = fulls;                                                 \
-                                                                         \
-    *(m) = (map) {                                                       \
-        .slots = MAP_INIT_SZ - 1,                                        \
-                                                                         \
-        .hash = hsh,                                                     \
-        .key_comp = kcmp,                                                \
-        .val_comp = vcmp,                                                \
-        .key_free = kfree,                                               \
-        .val_free = vfree,                                               \
-                                                                         \
-        .key_is_ptr = (kcmp==map_ptr_comp||kcmp==map_str_comp),          \
-        .val_is_ptr = (vcmp==map_ptr_comp||vcmp==map_str_comp),          \
-                                                                         \
-        .entries = entries,                                              \
-        .entry_sz = sizeof(*entries),                                    \
-                                                                         \
-        .list_head_off = anon_offsetof(entries,entry_list),              \
-        .flag_off = anon_offsetof(entries,flags),                        \
-        .key_off = anon_offsetof(entries,key),                           \
-        .key_sz = ksz,                                                   \
-        .val_off = anon_offsetof(entries,val),                           \
-        .val_sz = vsz,                                                   \
-    };                                                                   \
-                                                                         \
-    __map_init_entries(m);                                               \
+    MAP_STRUCT(ktype,vtype) entries[1]; /* Only for sizeof and offsets */\
+    __map_setup(                                                         \
+        m, sizeof(*entries),                                             \
+        anon_offsetof(entries,entry_list),                               \
+        anon_offsetof(entries,flags),                                    \
+        anon_offsetof(entries,hash),                                     \
+        anon_offsetof(entries,key), ksz,                                 \
+        anon_offsetof(entries,val), vsz,                                 \
+        hsh, kcmp, vcmp, kfree, vfree                                    \
+    );                                                                   \
 } while(0)
 
 //Some little helper macros
-#define map_full(m) (list_empty(&(m)->empties))
-#define __map_first_free_entry(m) ((m)->empties.next)
+#define map_full(m) (list_empty(&(m)->empties) && (m)->fresh > (m)->slots)
+#define map_size(m) ((m)->count)
 //Confirmed that these add no overhead when compiling with -O2
 //(thanks, Godbolt!)
 #define RV_AMP(x) ((__typeof__(x)[1]){x})
@@ -349,13 +511,28 @@ do {                                                               \
     assert((m)->entry_sz == sizeof(*dummy));                       \
     assert((m)->list_head_off == anon_offsetof(dummy,entry_list)); \
     assert((m)->flag_off == anon_offsetof(dummy,flags));           \
+    assert((m)->hash_off == anon_offsetof(dummy,hash));            \
     assert((m)->key_off == anon_offsetof(dummy,key));              \
     assert((m)->val_off == anon_offsetof(dummy,val));              \
 } while (0)
 
 
+//Turns a hash into an index in the entries array. This used to be 
+//hash % slots (with slots = 2^k - 1), but that's a real division on every 
+//single lookup. Now slots is a power of two and we use Fibonacci hashing:
+//multiply by 2^32/phi and keep the top bits. That's just as cheap as a 
+//mask, and unlike a mask it still spreads things out nicely if someone 
+//gives us a hash function with lousy low bits. The +1 skips the sentinel.
+static inline uint32_t __map_idx_bits(uint32_t hash, unsigned bits) {
+    return ((uint32_t)(hash * 2654435769u) >> (32 - bits)) + 1;
+}
+#define __map_idx(md, hash) __map_idx_bits(hash, (md)->slot_bits)
+
+//If an incremental resize is in progress, map_begin finishes it first
+//(otherwise we'd have to iterate over two tables).
 typedef list_head *map_iter;
-#define map_begin(m) (((list_head*)((m)->entries + (m)->list_head_off))->next)
+#define map_begin(m) \
+    (__map_rehash_finish(m), ((list_head*)((m)->entries + (m)->list_head_off))->next)
 #define map_iter_step(it) ((it) = (it)->next)
 //Was there a reason to write this as a macro?
 #define map_iter_deref(m, it, k_dst, v_dst)                           \
@@ -368,47 +545,117 @@ do {                                                                  \
 } while(0)
 #define map_end(m) ((list_head*)((m)->entries + (m)->list_head_off))
 
+#define __map_entry_hash(m, e) (*(uint32_t*)((void*)(e) + (m)->hash_off))
+
 #endif
 
-//Internal function that sets up the free list of entries.
+//Internal function that sets up the free list of entries. This used to 
+//link every single slot into the empties list, but that's O(slots) work 
+//(and it touches every page of a freshly calloc'd table) right in the 
+//middle of an incremental resize. Now the empties list starts out empty 
+//and md->fresh says where the never-used slots start. The table has to 
+//be zeroed for this to work: a slot that isn't filled and has a NULL 
+//next pointer is one that has never been used.
 void __map_init_entries(map *md)
 #ifdef MM_IMPLEMENT
 {
-    list_head *head = &md->empties;
-    //Get the list_head from the first (non-sentinel) entry
-    head->next = md->entries + md->entry_sz + md->list_head_off;
-    
-    list_head *cur = head->next;
-    list_head *prev = head;
+    md->empties.next = &md->empties;
+    md->empties.prev = &md->empties;
+    md->fresh = 1; //Skip the sentinel
+}
+#else
+;
+#endif
 
-    //Do the first slots-1 entries
-    int i;
-    for (i = 0; i < md->slots - 1; i++) {
-        list_head *next = (void*)cur + md->entry_sz;
-        cur->prev = prev;
-        cur->next = next;
-        prev = cur;
-        cur = next;
+#ifdef MM_IMPLEMENT
+#define __map_slot_unused(m, e) (                              \
+    !((__entry_flags*)((void*)(e) + (m)->flag_off))->is_filled && \
+    ((list_head*)((void*)(e) + (m)->list_head_off))->next == NULL \
+)
+
+//Moves md->fresh past any slots that got used out of order (because a key 
+//hashed straight to them). fresh never goes backwards, so all the calls 
+//to this add up to O(slots) over the life of the table.
+static void __map_skip_used(map *md) {
+    while (
+        md->fresh <= md->slots && 
+        !__map_slot_unused(md, md->entries + md->entry_sz*md->fresh)
+    ) {
+        md->fresh++;
+    }
+}
+
+//Takes a free slot out of the free list and returns its list_head. Don't 
+//call this if map_full is true.
+static list_head *__map_take_free_entry(map *md) {
+    if (md->fresh <= md->slots) {
+        void *entry = md->entries + md->entry_sz*md->fresh;
+        md->fresh++;
+        __map_skip_used(md);
+        return entry + md->list_head_off;
     }
+    list_head *node = md->empties.next;
+    list_del(node);
+    return node;
+}
+#endif
+
+//The part of map_custom_init (and set_custom_init, in set.h) that doesn't 
+//need to know the entry type. Everything about the entries' layout gets 
+//passed in, and every other field of the map starts out zero/NULL.
+void __map_setup(
+    map *md, unsigned entry_sz,
+    unsigned list_head_off, unsigned flag_off, unsigned hash_off,
+    unsigned key_off, unsigned key_sz,
+    unsigned val_off, unsigned val_sz,
+    map_hash_fn *hash, 
+    map_comp_fn *key_comp, map_comp_fn *val_comp,
+    map_free_fn *key_free, map_free_fn *val_free
+)
+#ifdef MM_IMPLEMENT
+{
+    void *entries = calloc(MAP_INIT_SZ + 1, entry_sz);
+    if (!entries) FAST_FAIL("out of memory");
+    list_head *fulls = entries + list_head_off;
+    fulls->next = fulls;
+    fulls->prev = fulls;
+
+    *md = (map) {
+        .slots = MAP_INIT_SZ,
+        .slot_bits = MAP_INIT_BITS,
+
+        .hash = hash,
+        .key_comp = key_comp,
+        .val_comp = val_comp,
+        .key_free = key_free,
+        .val_free = val_free,
+
+        .key_is_ptr = (key_comp==map_ptr_comp||key_comp==map_str_comp),
+        .val_is_ptr = (val_comp==map_ptr_comp||val_comp==map_str_comp),
+
+        .entries = entries,
+        .entry_sz = entry_sz,
+
+        .list_head_off = list_head_off,
+        .flag_off = flag_off,
+        .hash_off = hash_off,
+        .key_off = key_off,
+        .key_sz = key_sz,
+        .val_off = val_off,
+        .val_sz = val_sz,
+    };
 
-    //The last entry needs to loop back around
-    cur->prev = prev;
-    cur->next = head;
-    head->prev = cur;
+    __map_init_entries(md);
 }
 #else
 ;
 #endif
 
-//Traverses entire list and checks if any of the keys/values should
-//be freed. TODO? Have a fast version that assumes no nodes need to 
-//be freed?
-void map_free(map *md)
 #ifdef MM_IMPLEMENT
-{
+static void __map_free_table(map *md, void *entries) {
     //Sentinel (first entry in array) is the head of the 
     //list of full nodes
-    list_head *head = md->entries + md->list_head_off;
+    list_head *head = entries + md->list_head_off;
 
     //Free all the nodes in the list.
     //Note: No need to manage linked list pointers since 
@@ -426,24 +673,131 @@ void map_free(map *md)
         }
     }
 
-    free(md->entries);
+    free(entries);
 }
-#else
-;
 #endif
 
-//Returns NULL if not found, or pointer to value if found
-void *map_search(map const *md, void const *k)
+#ifdef MM_IMPLEMENT
+//The reverse index is a plain chained hash table (using list.h's hlist) 
+//from the hash of a value to the keys of the entries holding that value. 
+//It stores keys instead of pointers to entries because entries move 
+//around all the time (inserts, deletes and resizes all shuffle them), 
+//but keys don't. Going from a key to its entry is just a map_search.
+struct __map_vnode {
+    hlist_node node;
+    uint32_t vhash;
+    //Really key_sz bytes (or a pointer, if key_is_ptr). It's a uint64_t
+    //array to keep it aligned.
+    uint64_t key[];
+};
+
+static inline uint32_t __map_vbucket(map const *md, uint32_t vhash) {
+    return (uint32_t)(vhash * 2654435769u) >> (32 - md->vindex_bits);
+}
+
+static void __map_vindex_grow(map *md) {
+    unsigned old_n = 1u << md->vindex_bits;
+    hlist_head *old = md->vindex;
+
+    md->vindex_bits++;
+    md->vindex = calloc(1u << md->vindex_bits, sizeof(hlist_head));
+    if (!md->vindex) FAST_FAIL("out of memory");
+
+    unsigned i;
+    for (i = 0; i < old_n; i++) {
+        while (!hlist_empty(&old[i])) {
+            hlist_node *n = old[i].first;
+            struct __map_vnode *vn = container_of(n, struct __map_vnode, node);
+            hlist_del(n);
+            hlist_add_head(&md->vindex[__map_vbucket(md, vn->vhash)], n);
+        }
+    }
+
+    free(old);
+}
+
+//pk and pv are the same as in __map_insert_hashed
+static void __map_vindex_add(map *md, void const *pk, void const *pv) {
+    unsigned key_sz = md->key_is_ptr ? sizeof(void*) : md->key_sz;
+    struct __map_vnode *vn = malloc(sizeof(struct __map_vnode) + key_sz);
+    if (!vn) FAST_FAIL("out of memory");
+    vn->vhash = md->val_hash(pv, md->val_sz);
+    memcpy(vn->key, pk, key_sz);
+    hlist_add_head(&md->vindex[__map_vbucket(md, vn->vhash)], &vn->node);
+
+    if (++md->vindex_count > (1u << md->vindex_bits)) __map_vindex_grow(md);
+}
+
+static void __map_vindex_del(map *md, void const *pk, void const *pv) {
+    uint32_t vhash = md->val_hash(pv, md->val_sz);
+    hlist_node *n;
+    for (n = md->vindex[__map_vbucket(md, vhash)].first; n; n = n->next) {
+        struct __map_vnode *vn = container_of(n, struct __map_vnode, node);
+        if (vn->vhash == vhash && !md->key_comp(vn->key, pk, md->key_sz)) {
+            hlist_del(n);
+            free(vn);
+            md->vindex_count--;
+            return;
+        }
+    }
+}
+
+static void __map_vindex_free(map *md) {
+    if (!md->vindex) return;
+
+    unsigned i;
+    for (i = 0; i < (1u << md->vindex_bits); i++) {
+        hlist_node *n = md->vindex[i].first;
+        while (n) {
+            hlist_node *next = n->next;
+            free(container_of(n, struct __map_vnode, node));
+            n = next;
+        }
+    }
+
+    free(md->vindex);
+    md->vindex = NULL;
+    md->vindex_count = 0;
+}
+#endif
+
+//Traverses entire list and checks if any of the keys/values should
+//be freed. TODO? Have a fast version that assumes no nodes need to 
+//be freed?
+void map_free(map *md)
 #ifdef MM_IMPLEMENT
 {
-    //See the big comment in the __map_metadata struct. This 
-    //is the trick that lets us avoid dealing with pointers-
-    //to-pointers.
-    void const *pk = md->key_is_ptr ? &k : k;
+    __map_vindex_free(md);
+    if (md->arena) {
+        //Nothing in the entries needs to be freed one at a time, so we
+        //don't even need to look at them
+        free(md->entries);
+        free(md->old_entries);
+        arena_free(md->arena);
+        free(md->arena);
+        md->arena = NULL;
+    } else {
+        __map_free_table(md, md->entries);
+        if (md->old_entries) __map_free_table(md, md->old_entries);
+    }
+    md->entries = NULL;
+    md->old_entries = NULL;
+}
+#else
+;
+#endif
 
-    uint32_t idx = (md->hash(pk, md->key_sz) % md->slots) + 1;
+#ifdef MM_IMPLEMENT
+//Looks for a key in one table (either md->entries or md->old_entries, with
+//the matching number of slot bits). Returns the entry, or NULL.
+static void *__map_find_entry(
+    map const *md, 
+    void *entries, unsigned bits,
+    void const *pk, uint32_t hash
+) {
+    uint32_t idx = __map_idx_bits(hash, bits);
     
-    void *cur_entry = md->entries + md->entry_sz*idx;
+    void *cur_entry = entries + md->entry_sz*idx;
 
     __entry_flags *flags = cur_entry + md->flag_off;
 
@@ -458,21 +812,110 @@ void *map_search(map const *md, void const *k)
     while(1) {
         void const *key_from_entry = cur_entry + md->key_off;
 
-        //If this matches the key, we're done
-        if (md->key_comp(key_from_entry, pk, md->key_sz) == 0) {
-            return cur_entry + md->val_off;
+        //If this matches the key, we're done. Only bother comparing 
+        //keys if the cached hashes match.
+        if (
+            __map_entry_hash(md, cur_entry) == hash && 
+            md->key_comp(key_from_entry, pk, md->key_sz) == 0
+        ) {
+            return cur_entry;
         }
 
         if (flags->is_last) break;
 
         //Otherwise, step all our variables to the next entry
         list_head_from_entry = list_head_from_entry->next;
-        cur_entry = list_head_from_entry - md->list_head_off;
+        cur_entry = ((void*)list_head_from_entry) - md->list_head_off;
         flags = cur_entry + md->flag_off;
     }
 
     return NULL;
 }
+
+//Looks in the current table, and then in the old one if we're in the 
+//middle of an incremental resize. Returns the entry, or NULL.
+static void *__map_find_entry_any(map const *md, void const *pk, uint32_t hash) {
+    void *ret = __map_find_entry(md, md->entries, md->slot_bits, pk, hash);
+    if (!ret && md->old_entries) {
+        ret = __map_find_entry(md, md->old_entries, md->old_slot_bits, pk, hash);
+    }
+    return ret;
+}
+
+//Is this entry in the old table?
+static int __map_in_old(map const *md, void const *entry) {
+    if (!md->old_entries) return 0;
+    void const *end = md->old_entries + md->entry_sz*((1u << md->old_slot_bits) + 1);
+    return entry >= md->old_entries && entry < end;
+}
+#endif
+
+//Returns NULL if not found, or pointer to value if found. (This does NOT 
+//help along an incremental resize, since it only gets a const map)
+void *map_search(map const *md, void const *k)
+#ifdef MM_IMPLEMENT
+{
+    //See the big comment in the __map_metadata struct. This 
+    //is the trick that lets us avoid dealing with pointers-
+    //to-pointers.
+    void const *pk = md->key_is_ptr ? &k : k;
+
+    void *entry = __map_find_entry_any(md, pk, md->hash(pk, md->key_sz));
+    return entry ? entry + md->val_off : NULL;
+}
+#else
+;
+#endif
+
+#ifndef MM_IMPLEMENT
+//How many keys map_search_batch has in flight at once. Enough to cover a 
+//trip to DRAM, but small enough that the prefetched lines don't get 
+//evicted before we come back for them.
+#define MAP_BATCH_SZ 32
+#endif
+
+//Looks up n keys at once, and sets out_vals[i] to the value for keys[i] 
+//(or NULL if it isn't there). keys is a plain array of your key type, like
+//in map_build_from.
+//
+//Calling map_search in a loop means one cache miss after another, since 
+//each lookup has to wait for its entry to come in from memory before the
+//next one can start. Instead, this hashes a group of keys and prefetches
+//all of their home slots first, then goes back and does the lookups. By
+//then, most of the entries are (hopefully) in cache, and the misses all 
+//overlapped with each other instead of happening one at a time. This is
+//only worth it for big tables; if the whole map fits in cache, just call
+//map_search.
+void map_search_batch(map const *md, void const *keys, unsigned long n, void **out_vals)
+#ifdef MM_IMPLEMENT
+{
+    unsigned key_stride = md->key_is_ptr ? sizeof(void*) : md->key_sz;
+    uint32_t hashes[MAP_BATCH_SZ];
+
+    unsigned long base;
+    for (base = 0; base < n; base += MAP_BATCH_SZ) {
+        unsigned cnt = (n - base < MAP_BATCH_SZ) ? n - base : MAP_BATCH_SZ;
+        void const *group = keys + base*key_stride;
+
+        //First pass: hash everything and start the loads
+        unsigned i;
+        for (i = 0; i < cnt; i++) {
+            uint32_t hash = md->hash(group + i*key_stride, md->key_sz);
+            hashes[i] = hash;
+            __builtin_prefetch(md->entries + md->entry_sz*__map_idx(md, hash));
+            if (md->old_entries) {
+                uint32_t old_idx = __map_idx_bits(hash, md->old_slot_bits);
+                __builtin_prefetch(md->old_entries + md->entry_sz*old_idx);
+            }
+        }
+
+        //Second pass: the actual lookups
+        for (i = 0; i < cnt; i++) {
+            void *entry = __map_find_entry_any(md, group + i*key_stride, hashes[i]);
+            out_vals[base + i] = entry ? entry + md->val_off : NULL;
+        }
+    }
+}
 #else
 ;
 #endif
@@ -483,8 +926,10 @@ static void fill_entry(
     map const *md,
     void const *k, int free_key,
     void const *v, int free_val,
+    uint32_t hash,
     int last
 ) {
+    __map_entry_hash(md, e) = hash;
     __entry_flags *flags = e + md->flag_off;
     flags->is_filled = 1;
     flags->is_last = last ? 1 : 0;
@@ -499,8 +944,23 @@ static void fill_entry(
     memcpy(e + md->val_off, v, val_sz);
 }
 
-static void map_expand(map *md) {
-    void *new_entries = calloc((md->slots+1)*2, md->entry_sz);
+static int __map_insert_hashed(
+    map *md,
+    void const *pk, int free_key,
+    void const *pv, int free_val,
+    uint32_t hash
+);
+
+static void __map_remove_entry(map *md, void *entry, int free_kv);
+static void __map_rehash_some(map *md, unsigned n);
+
+//Moves everything into a new table with 1 << bits slots. If incremental is
+//set, the move is only started here and __map_rehash_some finishes it.
+static void __map_resize(map *md, unsigned bits, int incremental) {
+    //Can't have two resizes going on at once
+    __map_rehash_finish(md);
+
+    void *new_entries = calloc((1u << bits) + 1, md->entry_sz);
     if (!new_entries) {
         FAST_FAIL("out of memory");
     }
@@ -516,50 +976,61 @@ static void map_expand(map *md) {
     list_head *head = md->entries + md->list_head_off;
 
     void *old_entries = md->entries; //Need to keep this so we can free later
-    //These need to be set so that __map_insert will work
+    unsigned old_bits = md->slot_bits;
+    //These need to be set so that __map_insert_hashed will work
     md->entries = new_entries;
-    md->slots = 2*(md->slots+1) - 1; //Another advantage of sentinel: 2n+1 is coprime with n
+    md->slots = 1u << bits;
+    md->slot_bits = bits;
 
     //Build the initial linked list of free nodes (note: this had to be 
     //done after setting the new entries in md)
     __map_init_entries(md);
 
+    if (incremental) {
+        //Incremental mode: just hang on to the old table and let 
+        //__map_rehash_some move entries out of it later on
+        md->old_entries = old_entries;
+        md->old_slot_bits = old_bits;
+        return;
+    }
+
     list_head *cur;
     for (cur = head->next; cur != head; cur = cur->next) {
-        //Annoying: because of my trick involving pointers that 
-        //simplifies the API, I have to "undo" already having a 
-        //pointer-to-pointer
-        void *entry = cur - md->list_head_off;
+        //The old entry already holds exactly what __map_insert_hashed
+        //wants (i.e. pointers-to-pointers when key_is_ptr/val_is_ptr),
+        //and we don't need to call the hash function again.
+        void *entry = ((void*)cur) - md->list_head_off;
         __entry_flags *flags = entry + md->flag_off;
-        void *k = entry + md->key_off;
-        if (md->key_is_ptr) k = *(void**)k;
-        void *v = entry + md->val_off;
-        if (md->val_is_ptr) v = *(void**)v;
-        map_insert(md, k, flags->free_key, v, flags->free_val);
+        __map_insert_hashed(
+            md, 
+            entry + md->key_off, flags->free_key, 
+            entry + md->val_off, flags->free_val,
+            __map_entry_hash(md, entry)
+        );
     }
 
     //Notice we don't call the specific freeing functions on the 
     //keys and values; we just free the old memory. 
     free(old_entries);
 }
+
+static void map_expand(map *md) {
+    __map_resize(md, md->slot_bits + 1, md->rehash_step != 0);
+}
 #endif
 
-//Returns 0 on success, 1 if previous value overwritten,
-//or negative on error
-int map_insert(
-    map *md, 
-    void const *k, int free_key,
-    void const *v, int free_val
-)
 #ifdef MM_IMPLEMENT
-{
-    //See the big comment in the __map_metadata struct. This 
-    //is the trick that lets us avoid dealing with pointers-
-    //to-pointers.
-    void const *pk = md->key_is_ptr ? &k : k;
-    void const *pv = md->val_is_ptr ? &v : v;
-
-    uint32_t idx = (md->hash(pk, md->key_sz) % md->slots) + 1;
+//Does the real work for map_insert. The key_is_ptr/val_is_ptr trick has 
+//already been applied to pk and pv, and hash is the hash of pk. This way
+//map_expand can feed entries straight from the old table without calling 
+//the hash function again.
+static int __map_insert_hashed(
+    map *md,
+    void const *pk, int free_key,
+    void const *pv, int free_val,
+    uint32_t hash
+) {
+    uint32_t idx = __map_idx(md, hash);
 
     void *hit_by_hash = md->entries + md->entry_sz*idx;
     __entry_flags *hbh_flags = hit_by_hash + md->flag_off;
@@ -569,12 +1040,14 @@ int map_insert(
     //new value and terminate early 
     if (!hbh_flags->is_filled) {
         //Move this node into the the linked list of 
-        //filled nodes
-        list_del(hbh_node);
+        //filled nodes (if it's never been used, it isn't in the
+        //empties list yet)
+        if (hbh_node->next) list_del(hbh_node);
         //Remember: sentinel (first entry in array) is head of list 
         //of filled nodes
         list_add((list_head*)(md->entries+md->list_head_off), hbh_node);
-        fill_entry(hit_by_hash, md, pk, free_key, pv, free_val, 1);
+        fill_entry(hit_by_hash, md, pk, free_key, pv, free_val, hash, 1);
+        if (idx == md->fresh) __map_skip_used(md);
         return 0;
     }
 
@@ -585,7 +1058,10 @@ int map_insert(
     __entry_flags *cur_flags = hbh_flags;
     while(1) {
         void *key = cur + md->key_off;
-        if (!md->key_comp(key, pk, md->key_sz)) {
+        if (
+            __map_entry_hash(md, cur) == hash && 
+            !md->key_comp(key, pk, md->key_sz)
+        ) {
             //Overwrite entry and return 1
             if (cur_flags->free_key) {
                 md->key_free(key);
@@ -595,14 +1071,14 @@ int map_insert(
             }
 
             //Notice we don't modify the is_last flag
-            fill_entry(cur, md, pk, free_key, pv, free_val, cur_flags->is_last);
+            fill_entry(cur, md, pk, free_key, pv, free_val, hash, cur_flags->is_last);
 
             return 1;
         }
 
         if (cur_flags->is_last) break;
         cur_node = cur_node->next;
-        cur = cur_node - md->list_head_off;
+        cur = ((void*)cur_node) - md->list_head_off;
         cur_flags = cur + md->flag_off;
     } 
 
@@ -618,14 +1094,12 @@ int map_insert(
         //implementation is pretty small compared to the time we're 
         //forced to spend to rehash everything into the new table
 
-        return map_insert(md, k, free_key, v, free_val);
+        return __map_insert_hashed(md, pk, free_key, pv, free_val, hash);
     }
 
-    list_head *free_entry_node = __map_first_free_entry(md);
-    void *free_entry = free_entry_node - md->list_head_off;
-
-    //Remove the free entry from the linked list of free nodes
-    list_del(free_entry_node);
+    //This also removes the free entry from the linked list of free nodes
+    list_head *free_entry_node = __map_take_free_entry(md);
+    void *free_entry = ((void*)free_entry_node) - md->list_head_off;
 
     //Is this an optimization? Instead of just putting the
     //new element into the free entry and adding that entry 
@@ -638,7 +1112,7 @@ int map_insert(
     //when we insert the free entry after the hit-by-hash 
     //element. 
     memcpy(free_entry, hit_by_hash, md->entry_sz);
-    fill_entry(hit_by_hash, md, pk, free_key, pv, free_val, 0);
+    fill_entry(hit_by_hash, md, pk, free_key, pv, free_val, hash, 0);
 
 
     //The situation now looks like this:
@@ -662,20 +1136,250 @@ int map_insert(
 
     return 0;
 }
+#endif
+
+#ifdef MM_IMPLEMENT
+static void *__map_arena_copy(map *md, void const *p, map_comp_fn *comp, unsigned sz) {
+    if (!p) return NULL;
+    if (comp == map_str_comp) return arena_strdup(md->arena, p);
+    return arena_memdup(md->arena, p, sz);
+}
+
+//For arena mode: points *pk and *pv at the map's own copies of a pointer 
+//key and value. The copied pointers go in k_copy and v_copy, since *pk and
+//*pv might be pointing into the caller's memory. If the key is already in
+//the map, the copy we made last time gets reused.
+static void __map_arena_adopt(
+    map *md, uint32_t hash,
+    void const **pk, void const **k_copy,
+    void const **pv, void const **v_copy
+) {
+    if (md->key_is_ptr) {
+        void const *orig = *(void const **) *pk;
+        void *e = __map_find_entry_any(md, *pk, hash);
+        if (e) *k_copy = *(void const **)(e + md->key_off);
+        else *k_copy = __map_arena_copy(md, orig, md->key_comp, md->key_sz);
+        *pk = k_copy;
+    }
+    if (md->val_is_ptr) {
+        void const *orig = *(void const **) *pv;
+        *v_copy = __map_arena_copy(md, orig, md->val_comp, md->val_sz);
+        *pv = v_copy;
+    }
+}
+#endif
+
+//Returns 0 on success, 1 if previous value overwritten,
+//or negative on error
+int map_insert(
+    map *md, 
+    void const *k, int free_key,
+    void const *v, int free_val
+)
+#ifdef MM_IMPLEMENT
+{
+    //See the big comment in the __map_metadata struct. This 
+    //is the trick that lets us avoid dealing with pointers-
+    //to-pointers.
+    void const *pk = md->key_is_ptr ? &k : k;
+    void const *pv = md->val_is_ptr ? &v : v;
+
+    uint32_t hash = md->hash(pk, md->key_sz);
+
+    if (md->old_entries) {
+        __map_rehash_some(md, md->rehash_step);
+    }
+
+    //In arena mode, the map keeps its own copies of pointer and string 
+    //keys and values, and never frees anything one entry at a time
+    void const *k_copy, *v_copy;
+    if (md->arena) {
+        __map_arena_adopt(md, hash, &pk, &k_copy, &pv, &v_copy);
+        free_key = 0;
+        free_val = 0;
+    }
+
+    //Keep the reverse index up to date. If the key is already there, its
+    //old value is about to be replaced (and maybe freed)
+    if (md->vindex) {
+        void *e = __map_find_entry_any(md, pk, hash);
+        if (e) __map_vindex_del(md, e + md->key_off, e + md->val_off);
+        __map_vindex_add(md, pk, pv);
+    }
+
+    //If the key is still waiting in the old table, overwrite it there
+    //(new entries always go in the new table, so a key is never in both)
+    if (md->old_entries) {
+        void *e = __map_find_entry(md, md->old_entries, md->old_slot_bits, pk, hash);
+        if (e) {
+            __entry_flags *flags = e + md->flag_off;
+            if (flags->free_key) md->key_free(e + md->key_off);
+            if (flags->free_val) md->val_free(e + md->val_off);
+            fill_entry(e, md, pk, free_key, pv, free_val, hash, flags->is_last);
+            return 1;
+        }
+    }
+
+    int ret = __map_insert_hashed(md, pk, free_key, pv, free_val, hash);
+    if (ret == 0) md->count++;
+    return ret;
+}
 #else
 ;
 #endif
 
+//Makes sure the map has room for at least n entries, so that the next n 
+//inserts (into an empty map) don't trigger any resizes. Unlike a resize 
+//from map_insert, this one always happens all at once, even if the map is 
+//in incremental mode (you asked for it, after all). Never shrinks the map.
+void map_reserve(map *md, unsigned long n)
 #ifdef MM_IMPLEMENT
-//If someone wants to search by value, there is no other alternative 
-//than to look through everything in the map. Returns the pointer to 
-//the value in the entry if found, or NULL if not found.
-static list_head *find_by_value(map *md, void const *v) {
+{
+    if (n <= md->slots) return;
+
+    //Check this before the loop, or else it could shift by 64 or more
+    if (n > (1ul << 31)) FAST_FAIL("map_reserve: too many entries");
+
+    unsigned bits = md->slot_bits;
+    while ((1ul << bits) < n) bits++;
+
+    __map_resize(md, bits, 0);
+}
+#else
+;
+#endif
+
+//Inserts n keys and values all at once. keys and vals are plain arrays of
+//your key and value types (so for STR2VAL, keys is an array of char 
+//pointers). free_key and free_val apply to every entry, and if a key 
+//shows up more than once the last one wins, same as calling map_insert n 
+//times. But this is a lot faster than calling map_insert n times:
+//  - The table is sized once up front instead of doubling its way there
+//  - The first pass drops every entry whose slot is still empty straight 
+//    into place (which is most of them). Only the ones that collided are 
+//    left for a second pass that goes through the normal insert path.
+void map_build_from(
+    map *md, 
+    void const *keys, int free_key, 
+    void const *vals, int free_val, 
+    unsigned long n
+)
+#ifdef MM_IMPLEMENT
+{
+    //If the map already had entries, it could still fill up partway 
+    //through. Any resize in here has to happen all at once, since 
+    //__map_insert_hashed only looks at the new table.
+    unsigned step = md->rehash_step;
+    md->rehash_step = 0;
+    __map_rehash_finish(md);
+    map_reserve(md, n);
+
+    //See the big comment in the __map_metadata struct. Since the arrays 
+    //hold the keys and values themselves, a pointer into the array is 
+    //already what __map_insert_hashed wants.
+    unsigned key_stride = md->key_is_ptr ? sizeof(void*) : md->key_sz;
+    unsigned val_stride = md->val_is_ptr ? sizeof(void*) : md->val_sz;
+
+    //Same as map_insert: in arena mode, every entry points at the map's 
+    //own copies, so none of them get freed one at a time
+    int own_key = md->arena ? 0 : free_key;
+    int own_val = md->arena ? 0 : free_val;
+
+    struct {
+        unsigned long i;
+        uint32_t hash;
+    } *collided = malloc(n * sizeof(*collided));
+    if (n && !collided) FAST_FAIL("out of memory");
+    unsigned long num_collided = 0;
+
+    unsigned long i;
+    for (i = 0; i < n; i++) {
+        void const *pk = keys + i*key_stride;
+        uint32_t hash = md->hash(pk, md->key_sz);
+
+        void *hit_by_hash = md->entries + md->entry_sz*__map_idx(md, hash);
+        __entry_flags *hbh_flags = hit_by_hash + md->flag_off;
+        if (hbh_flags->is_filled) {
+            collided[num_collided].i = i;
+            collided[num_collided].hash = hash;
+            num_collided++;
+            continue;
+        }
+
+        void const *pv = vals + i*val_stride;
+        void const *k_copy, *v_copy;
+        if (md->arena) {
+            __map_arena_adopt(md, hash, &pk, &k_copy, &pv, &v_copy);
+        }
+
+        //Slot is empty, so this is the fast path in __map_insert_hashed 
+        //(no bucket to search, nothing to move). It also means the key 
+        //isn't in the map yet, so there's no old value to unindex.
+        if (md->vindex) __map_vindex_add(md, pk, pv);
+        md->count++;
+        __map_insert_hashed(md, pk, own_key, pv, own_val, hash);
+    }
+
+    //Everything that collided. The entries are in the same order they 
+    //were in the arrays, so duplicate keys still resolve to the last one
+    for (i = 0; i < num_collided; i++) {
+        unsigned long j = collided[i].i;
+        uint32_t hash = collided[i].hash;
+        void const *pk = keys + j*key_stride;
+        void const *pv = vals + j*val_stride;
+        void const *k_copy, *v_copy;
+        if (md->arena) {
+            __map_arena_adopt(md, hash, &pk, &k_copy, &pv, &v_copy);
+        }
+
+        if (md->vindex) {
+            //Same as in map_insert: the key might already be there (from
+            //before, or from earlier in the arrays)
+            void *e = __map_find_entry(md, md->entries, md->slot_bits, pk, hash);
+            if (e) __map_vindex_del(md, e + md->key_off, e + md->val_off);
+            __map_vindex_add(md, pk, pv);
+        }
+        int overwrote = __map_insert_hashed(md, pk, own_key, pv, own_val, hash);
+        if (!overwrote) md->count++;
+    }
+
+    free(collided);
+    md->rehash_step = step;
+}
+#else
+;
+#endif
+
+#ifdef MM_IMPLEMENT
+//If someone wants to search by value and there's no reverse index, there 
+//is no other alternative than to look through everything in the map. 
+//Returns the pointer to the value in the entry if found, or NULL if not 
+//found.
+static void *find_by_value(map *md, void const *v) {
     //See the big comment in the __map_metadata struct. This 
     //is the trick that lets us avoid dealing with pointers-
     //to-pointers.
     void const *pv = md->val_is_ptr ? &v : v;
 
+    if (md->vindex) {
+        uint32_t vhash = md->val_hash(pv, md->val_sz);
+        hlist_node *n;
+        for (n = md->vindex[__map_vbucket(md, vhash)].first; n; n = n->next) {
+            struct __map_vnode *vn = container_of(n, struct __map_vnode, node);
+            if (vn->vhash != vhash) continue;
+
+            void *e = __map_find_entry_any(md, vn->key, md->hash(vn->key, md->key_sz));
+            if (e && md->val_comp(e + md->val_off, pv, md->val_sz) == 0) {
+                return e + md->val_off;
+            }
+        }
+        return NULL;
+    }
+
+    //We're about to look at every entry anyway, so we may as well get
+    //any incremental resize out of the way
+    __map_rehash_finish(md);
+
     //Remember: sentinel (first element of entries array) is the 
     //head of list of filled nodes
     list_head *head = md->entries + md->list_head_off;
@@ -683,7 +1387,7 @@ static list_head *find_by_value(map *md, void const *v) {
     list_head *cur;
     for (cur = head->next; cur != head; cur = cur->next) {
         void *val = ((void*)cur) - md->list_head_off + md->val_off;
-        if (md->val_comp(val, pv, md->val_sz)) {
+        if (md->val_comp(val, pv, md->val_sz) == 0) {
             return val;
         }
     }
@@ -692,51 +1396,36 @@ static list_head *find_by_value(map *md, void const *v) {
 }
 #endif
 
-//Searches for either k_needle or v_needle depending on which one 
-//is not NULL. If both are given, will search using key but will also 
-//make sure value matches. Returns 0 if entry was deleted, 1 if it 
-//wasn't found, or negative on error
-int map_search_delete(map *md, void const *k_needle, void const *v_needle)
 #ifdef MM_IMPLEMENT
-{
-    void *found_val;
-
-    if (k_needle) {
-        found_val = map_search(md, k_needle);
-        if (!found_val) return 1; //Not found
-
-        //If the user also gave a value, make sure that the value 
-        //found in this entry matches it:
-        if (v_needle) {
-            //See the big comment in the __map_metadata struct. This 
-            //is the trick that lets us avoid dealing with pointers-
-            //to-pointers.
-            void const *pv = md->val_is_ptr ? &v_needle : v_needle;
-            if (md->val_comp(found_val, pv, md->val_sz) != 0) {
-                return 1; // Not found 
-            }
-        }
-    } else {
-        found_val = find_by_value(md, v_needle);
-        if (!found_val) return 1; //Not found
-    }
-
-    //If we made it here, it's because we need to get deletin'
-    void *entry = found_val - md->val_off;
+//Takes an entry out of whichever table it's in. If free_kv is set, the key
+//and value are freed (if their flags say so); otherwise the caller is 
+//taking ownership of them.
+static void __map_remove_entry(map *md, void *entry, int free_kv) {
     list_head *node = entry + md->list_head_off;
     __entry_flags *flags = entry + md->flag_off;
 
-    //Compute the hash of this value before we free the key.
-    //The reason we do this will become clear later.
-    uint32_t hash = md->hash(entry+md->key_off, md->key_sz);
-    uint32_t idx = (hash % md->slots) + 1;
+    //Figure out which table this entry lives in
+    int in_old = __map_in_old(md, entry);
+    void *entries = in_old ? md->old_entries : md->entries;
+    unsigned bits = in_old ? md->old_slot_bits : md->slot_bits;
+
+    //We'll need to know which bucket this entry belongs to. The
+    //reason will become clear later.
+    uint32_t idx = __map_idx_bits(__map_entry_hash(md, entry), bits);
+
+    //A real delete (as opposed to moving the entry to the new table) 
+    //takes it out of the reverse index too
+    if (free_kv && md->vindex) {
+        __map_vindex_del(md, entry + md->key_off, entry + md->val_off);
+    }
+    if (free_kv) md->count--;
 
     //Free key and value, if necessary
-    if (flags->free_key) {
+    if (free_kv && flags->free_key) {
         md->key_free(entry + md->key_off);
     }
-    if (flags->free_val) {
-        md->val_free(found_val);
+    if (free_kv && flags->free_val) {
+        md->val_free(entry + md->val_off);
     }
 
     //Here's where things get a little insane. If this entry is 
@@ -752,21 +1441,24 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle)
     //     things maangeable for the API. I'm half done this
     //     same implementation in C++ and I don't feel that it's
     //     as hacky.
-    if (entry == md->entries + md->entry_sz*idx && !flags->is_last) {
+    if (entry == entries + md->entry_sz*idx && !flags->is_last) {
         //Follow this bucket until we find the next element with 
         //the same index after hashing
         list_head *cur_node = node->next;
-        list_head *sentinel_node = md->entries + md->list_head_off;
+        list_head *sentinel_node = entries + md->list_head_off;
         while(cur_node != sentinel_node) {
             void *cur_entry = ((void*)cur_node) - md->list_head_off;
             __entry_flags *cur_flags = cur_entry + md->flag_off;
 
             void *pk = cur_entry + md->key_off;
-            uint32_t cur_hash = md->hash(pk,md->entry_sz);
-            uint32_t cur_idx = (cur_hash % md->slots) + 1;
+            uint32_t cur_hash = __map_entry_hash(md, cur_entry);
+            uint32_t cur_idx = __map_idx_bits(cur_hash, bits);
             
             if(cur_idx == idx) {
-                //Overwrite the found entry with this one
+                //Overwrite the found entry with this one. Notice that
+                //we keep our own is_last flag (which is 0, since cur 
+                //comes after us). If cur was the last entry, the code 
+                //after this loop hands its is_last flag to its prev.
                 fill_entry(
                     entry, 
                     md, 
@@ -774,7 +1466,8 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle)
                     cur_flags->free_key, 
                     cur_entry + md->val_off,
                     cur_flags->free_val,
-                    cur_flags->is_last
+                    cur_hash,
+                    0
                 );
 
                 //Now set these variables from the outer scope
@@ -836,10 +1529,170 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle)
     flags->is_filled = 0; 
     list_del(node);
 
-    //Add back into list of empty nodes
-    list_add(&md->empties, node);
+    //Add back into list of empty nodes. (The old table never gets 
+    //any new entries, so it doesn't need a free list)
+    if (!in_old) list_add(&md->empties, node);
+}
+
+//Moves up to n entries from the old table into the new one. Frees the old
+//table once it's empty.
+static void __map_rehash_some(map *md, unsigned n) {
+    while (md->old_entries) {
+        list_head *head = md->old_entries + md->list_head_off;
+        if (list_empty(head)) {
+            free(md->old_entries);
+            md->old_entries = NULL;
+            break;
+        }
+        if (n-- == 0) break;
+
+        //The old entry already holds exactly what __map_insert_hashed
+        //wants (i.e. pointers-to-pointers when key_is_ptr/val_is_ptr),
+        //and the new table takes over ownership of the key and value.
+        void *entry = ((void*)head->next) - md->list_head_off;
+        __entry_flags *flags = entry + md->flag_off;
+        __map_insert_hashed(
+            md, 
+            entry + md->key_off, flags->free_key, 
+            entry + md->val_off, flags->free_val,
+            __map_entry_hash(md, entry)
+        );
+        __map_remove_entry(md, entry, 0);
+    }
+}
+#endif
+
+//Finishes any incremental resize that's in progress
+void __map_rehash_finish(map *md)
+#ifdef MM_IMPLEMENT
+{
+    if (md->old_entries) __map_rehash_some(md, -1u);
+}
+#else
+;
+#endif
+
+//Switches the map to incremental resizing. Normally, when the map fills up,
+//map_insert allocates a table twice as big and moves everything over before
+//returning, which is a nasty latency spike for a big map. With step > 0, 
+//the old table sticks around after a resize and each map_insert and 
+//map_search_delete moves (at most) step entries out of it. Lookups check 
+//both tables in the meantime. step = 0 goes back to resizing all at once
+//(and finishes any resize in progress).
+void map_set_incremental(map *md, unsigned step)
+#ifdef MM_IMPLEMENT
+{
+    md->rehash_step = step;
+    if (step == 0) __map_rehash_finish(md);
+}
+#else
+;
+#endif
+
+//Switches an empty map to arena mode. From then on, map_insert and 
+//map_build_from copy pointer and string keys and values into an arena 
+//owned by the map (value-typed keys and values already live inside the 
+//entries), and the free_key/free_val arguments are ignored: what you pass
+//in is still yours afterwards. map_free then releases everything in one 
+//go, without calling key_free or val_free on each entry. The catch is 
+//that nothing is given back until map_free: deleted or overwritten values
+//stay in the arena.
+//
+//  map m;
+//  map_init(&m, char*, char*, STR2STR);
+//  map_use_arena(&m);
+//  map_insert(&m, header_name, 0, header_value, 0); //Both get copied
+//  ...
+//  map_free(&m);
+void map_use_arena(map *md)
+#ifdef MM_IMPLEMENT
+{
+    if (md->arena) return;
+    if (md->count != 0) FAST_FAIL("map_use_arena needs an empty map");
+
+    md->arena = malloc(sizeof(arena));
+    if (!md->arena) FAST_FAIL("out of memory");
+    arena_init(md->arena);
+}
+#else
+;
+#endif
+
+#ifndef MM_IMPLEMENT
+//map_search_delete shrinks the map when it's less than 1/MAP_SHRINK_DIV 
+//full
+#define MAP_SHRINK_DIV 8
+#endif
+
+//Shrinks the map down to the smallest table that's at most half full (the
+//same size map_search_delete shrinks to). The new table is also nicely 
+//packed, since the entries get reinserted from scratch. Like growing, 
+//this happens a few entries at a time if the map is in incremental mode.
+//Does nothing if the map is already that small.
+void map_compact(map *md)
+#ifdef MM_IMPLEMENT
+{
+    __map_rehash_finish(md);
+
+    //Half full is important for incremental mode: every insert during
+    //the move also moves at least one old entry, so the new table only 
+    //has to fit count entries plus at most count more inserts
+    unsigned bits = MAP_INIT_BITS;
+    while ((1ul << bits) < 2ul*md->count) bits++;
+    if (bits >= md->slot_bits) return;
+
+    __map_resize(md, bits, md->rehash_step != 0);
+}
+#else
+;
+#endif
 
-    //Phew, done!
+//Searches for either k_needle or v_needle depending on which one 
+//is not NULL. If both are given, will search using key but will also 
+//make sure value matches. Returns 0 if entry was deleted, 1 if it 
+//wasn't found, or negative on error
+int map_search_delete(map *md, void const *k_needle, void const *v_needle)
+#ifdef MM_IMPLEMENT
+{
+    void *found_val;
+
+    if (md->old_entries) {
+        __map_rehash_some(md, md->rehash_step);
+    }
+
+    if (k_needle) {
+        found_val = map_search(md, k_needle);
+        if (!found_val) return 1; //Not found
+
+        //If the user also gave a value, make sure that the value 
+        //found in this entry matches it:
+        if (v_needle) {
+            //See the big comment in the __map_metadata struct. This 
+            //is the trick that lets us avoid dealing with pointers-
+            //to-pointers.
+            void const *pv = md->val_is_ptr ? &v_needle : v_needle;
+            if (md->val_comp(found_val, pv, md->val_sz) != 0) {
+                return 1; // Not found 
+            }
+        }
+    } else {
+        found_val = find_by_value(md, v_needle);
+        if (!found_val) return 1; //Not found
+    }
+
+    //If we made it here, it's because we need to get deletin'
+    __map_remove_entry(md, found_val - md->val_off, 1);
+
+    //Give memory back if the map has mostly drained. Don't bother if a 
+    //resize is still going on; we'll get another chance on the next 
+    //delete.
+    if (
+        !md->old_entries && 
+        md->slots > MAP_INIT_SZ && 
+        md->count < md->slots / MAP_SHRINK_DIV
+    ) {
+        map_compact(md);
+    }
     
     return 0;
 }
@@ -847,6 +1700,57 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle)
 ;
 #endif
 
+//Turns on the reverse index, which makes map_search_by_value and deleting
+//by value (map_search_delete with only v_needle) O(1) instead of a walk 
+//over every entry. It costs a small allocation per entry and a little 
+//extra work on every insert and delete. val_hash hashes values the same 
+//way the map's hash function hashes keys; if it's NULL, the wyhash 
+//function matching the map's value comparison function is used (this 
+//only works with the VAL2VAL etc. helpers).
+void map_enable_value_index(map *md, map_hash_fn *val_hash)
+#ifdef MM_IMPLEMENT
+{
+    if (md->vindex) return;
+
+    if (!val_hash) {
+        if (md->val_comp == map_val_comp) val_hash = map_val_wyhash;
+        else if (md->val_comp == map_ptr_comp) val_hash = map_ptr_wyhash;
+        else if (md->val_comp == map_str_comp) val_hash = map_str_wyhash;
+        else FAST_FAIL("map_enable_value_index needs a hash function for custom value types");
+    }
+
+    md->val_hash = val_hash;
+    md->vindex_bits = 4;
+    md->vindex_count = 0;
+    md->vindex = calloc(1u << md->vindex_bits, sizeof(hlist_head));
+    if (!md->vindex) FAST_FAIL("out of memory");
 
+    //Index everything that's already in the map
+    list_head *cur;
+    for (cur = map_begin(md); cur != map_end(md); cur = cur->next) {
+        void *entry = ((void*)cur) - md->list_head_off;
+        __map_vindex_add(md, entry + md->key_off, entry + md->val_off);
+    }
+}
+#else
+;
+#endif
 
+//Returns a pointer to the key of some entry whose value is v, or NULL if
+//there isn't one. v follows the same rules as in map_insert. Without the 
+//reverse index, this has to look at every entry.
+void *map_search_by_value(map *md, void const *v)
+#ifdef MM_IMPLEMENT
+{
+    void *found_val = find_by_value(md, v);
+    return found_val ? found_val - md->val_off + md->key_off : NULL;
+}
+#else
+;
+#endif
+
+
+
+#else
+#undef SHOULD_INCLUDE
 #endif
@@ -0,0 +1,262 @@
+#ifndef MAP_DEFINE_H
+#define MAP_DEFINE_H 1
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "fast_fail.h"
+
+//map.h is generic at runtime: every operation calls the hash and compare
+//functions through pointers, checks key_is_ptr/val_is_ptr, and finds the
+//key and value using offsets stored in the map. (As the comment in map.h
+//says, C++ templates would have prevented this mess). This header is the
+//closest thing C has to templates: MAP_DEFINE stamps out a map for one
+//specific key and value type, with all static inline functions. The
+//compiler sees the real types and the real hash and compare code, so it
+//can inline everything and all the offsets become constants.
+//
+//The table itself is the same Robin Hood scheme as rh_map.h.
+//
+//  MAP_DEFINE(ktype, vtype, prefix, hash_expr, eq_expr)
+//
+//hash_expr and eq_expr are anything that can be called like a function:
+//hash_expr(k) gives a 32 bit hash, and eq_expr(a, b) is nonzero when two
+//keys are equal. Macros are fine (and are the point; they get inlined).
+//This defines the types prefix_map and prefix_entry (which has .key and 
+//.val members), and the functions:
+//
+//  void            prefix_init(prefix_map *m);
+//  void            prefix_free(prefix_map *m);
+//  vtype*          prefix_search(prefix_map const *m, ktype k);
+//  int             prefix_insert(prefix_map *m, ktype k, vtype v);
+//  int             prefix_delete(prefix_map *m, ktype k, prefix_entry *old);
+//  unsigned long   prefix_begin(prefix_map const *m);
+//  unsigned long   prefix_end(prefix_map const *m);
+//  unsigned long   prefix_next(prefix_map const *m, unsigned long it);
+//  prefix_entry*   prefix_at(prefix_map const *m, unsigned long it);
+//
+//Keys and values are stored by value and the map never frees them. If
+//they own memory, use prefix_delete's old argument (or iterate before
+//calling prefix_free) to clean up. Careful: inserting a key that's already
+//there replaces both the key and the value.
+//
+//Example:
+//
+//  MAP_DEFINE(uint32_t, float, u2f, MAPDEF_INT_HASH, MAPDEF_EQ)
+//  MAP_DEFINE(char const *, int, s2i, MAPDEF_STR_HASH, MAPDEF_STR_EQ)
+//
+//  u2f_map m;
+//  u2f_init(&m);
+//  u2f_insert(&m, 7, 1.5f);
+//  float *f = u2f_search(&m, 7);
+//
+//  unsigned long it;
+//  for (it = u2f_begin(&m); it != u2f_end(&m); it = u2f_next(&m, it)) {
+//      u2f_entry *e = u2f_at(&m, it);
+//      printf("%u -> %f\n", e->key, e->val);
+//  }
+//  u2f_free(&m);
+
+//Must be a power of two
+#define MAPDEF_INIT_SZ 8
+
+//Max load factor, as a fraction out of 10
+#define MAPDEF_MAX_LOAD 9
+
+typedef struct {
+    uint32_t hash;
+    uint32_t dist; //Distance from home slot, plus one. 0 means empty
+} mapdef_meta;
+
+//Fibonacci hashing, same as map.h
+static inline uint32_t __mapdef_home(uint32_t hash, unsigned bits) {
+    return (uint32_t) (hash * 2654435769u) >> (32 - bits);
+}
+
+//Some ready-made hash and compare functions. The integer hash is the 
+//murmur3 64 bit finalizer, which is cheap and mixes well enough that the 
+//top bits (which pick the home slot) depend on all of the key.
+static inline uint32_t mapdef_int_hash(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return (uint32_t) x;
+}
+
+//FNV-1a. Not the fastest string hash around, but it's four lines and it 
+//inlines
+static inline uint32_t mapdef_str_hash(char const *s) {
+    uint32_t h = 2166136261u;
+    while (*s) h = (h ^ (uint8_t) *s++) * 16777619u;
+    return h ^ (h >> 16);
+}
+
+#define MAPDEF_INT_HASH(k) mapdef_int_hash((uint64_t) (k))
+#define MAPDEF_STR_HASH(k) mapdef_str_hash(k)
+#define MAPDEF_EQ(a, b) ((a) == (b))
+#define MAPDEF_STR_EQ(a, b) (strcmp((a), (b)) == 0)
+
+#define MAP_DEFINE(ktype, vtype, prefix, hash_expr, eq_expr)                            \
+typedef struct {                                                                        \
+    ktype key;                                                                          \
+    vtype val;                                                                          \
+} prefix##_entry;                                                                       \
+                                                                                        \
+typedef struct {                                                                        \
+    mapdef_meta *meta;                                                                  \
+    prefix##_entry *slots;                                                              \
+    uint32_t capacity;                                                                  \
+    unsigned cap_bits;                                                                  \
+    uint32_t size;                                                                      \
+} prefix##_map;                                                                         \
+                                                                                        \
+static inline void prefix##_init(prefix##_map *m) {                                     \
+    m->meta = calloc(MAPDEF_INIT_SZ, sizeof(mapdef_meta));                              \
+    m->slots = malloc(MAPDEF_INIT_SZ*sizeof(prefix##_entry));                           \
+    if (!m->meta || !m->slots) FAST_FAIL("out of memory");                              \
+    m->capacity = MAPDEF_INIT_SZ;                                                       \
+    m->cap_bits = __builtin_ctz(MAPDEF_INIT_SZ);                                        \
+    m->size = 0;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* Does not free the keys and values themselves (that's up to you) */                   \
+static inline void prefix##_free(prefix##_map *m) {                                     \
+    free(m->meta);                                                                      \
+    free(m->slots);                                                                     \
+    m->meta = NULL;                                                                     \
+    m->slots = NULL;                                                                    \
+    m->capacity = 0;                                                                    \
+    m->size = 0;                                                                        \
+}                                                                                       \
+                                                                                        \
+static inline long prefix##__find(prefix##_map const *m, ktype k, uint32_t hash) {      \
+    uint32_t mask = m->capacity - 1;                                                    \
+    uint32_t i = __mapdef_home(hash, m->cap_bits);                                      \
+    uint32_t dist = 1;                                                                  \
+    while (m->meta[i].dist >= dist) {                                                   \
+        if (m->meta[i].hash == hash && (eq_expr(m->slots[i].key, k))) {                 \
+            return i;                                                                   \
+        }                                                                               \
+        i = (i + 1) & mask;                                                             \
+        dist++;                                                                         \
+    }                                                                                   \
+    return -1;                                                                          \
+}                                                                                       \
+                                                                                        \
+/* Key must not be in the table, and there must be room */                              \
+static inline void prefix##__place(prefix##_map *m, prefix##_entry e, uint32_t hash) {  \
+    uint32_t mask = m->capacity - 1;                                                    \
+    uint32_t i = __mapdef_home(hash, m->cap_bits);                                      \
+    uint32_t dist = 1;                                                                  \
+    while (m->meta[i].dist != 0) {                                                      \
+        if (m->meta[i].dist < dist) {                                                   \
+            mapdef_meta tm = m->meta[i];                                                \
+            prefix##_entry te = m->slots[i];                                            \
+            m->meta[i].hash = hash;                                                     \
+            m->meta[i].dist = dist;                                                     \
+            m->slots[i] = e;                                                            \
+            hash = tm.hash;                                                             \
+            dist = tm.dist;                                                             \
+            e = te;                                                                     \
+        }                                                                               \
+        i = (i + 1) & mask;                                                             \
+        dist++;                                                                         \
+    }                                                                                   \
+    m->meta[i].hash = hash;                                                             \
+    m->meta[i].dist = dist;                                                             \
+    m->slots[i] = e;                                                                    \
+    m->size++;                                                                          \
+}                                                                                       \
+                                                                                        \
+static inline void prefix##__grow(prefix##_map *m) {                                    \
+    mapdef_meta *old_meta = m->meta;                                                    \
+    prefix##_entry *old_slots = m->slots;                                               \
+    uint32_t old_cap = m->capacity;                                                     \
+    if (old_cap*2 < old_cap) FAST_FAIL(#prefix " map is too big");                      \
+                                                                                        \
+    m->meta = calloc(old_cap*2, sizeof(mapdef_meta));                                   \
+    m->slots = malloc((size_t) old_cap*2*sizeof(prefix##_entry));                       \
+    if (!m->meta || !m->slots) FAST_FAIL("out of memory");                              \
+    m->capacity = old_cap*2;                                                            \
+    m->cap_bits++;                                                                      \
+    m->size = 0;                                                                        \
+                                                                                        \
+    uint32_t i;                                                                         \
+    for (i = 0; i < old_cap; i++) {                                                     \
+        if (old_meta[i].dist) prefix##__place(m, old_slots[i], old_meta[i].hash);       \
+    }                                                                                   \
+    free(old_meta);                                                                     \
+    free(old_slots);                                                                    \
+}                                                                                       \
+                                                                                        \
+/* Returns pointer to value in the map, or NULL if not found */                         \
+static inline vtype *prefix##_search(prefix##_map const *m, ktype k) {                  \
+    long i = prefix##__find(m, k, (uint32_t) (hash_expr(k)));                           \
+    return (i < 0) ? NULL : &m->slots[i].val;                                           \
+}                                                                                       \
+                                                                                        \
+/* Returns 0 on success, 1 if previous value overwritten */                             \
+static inline int prefix##_insert(prefix##_map *m, ktype k, vtype v) {                  \
+    uint32_t hash = (uint32_t) (hash_expr(k));                                          \
+    long i = prefix##__find(m, k, hash);                                                \
+    if (i >= 0) {                                                                       \
+        m->slots[i].key = k;                                                            \
+        m->slots[i].val = v;                                                            \
+        return 1;                                                                       \
+    }                                                                                   \
+    if ((uint64_t) (m->size + 1)*10 > (uint64_t) m->capacity*MAPDEF_MAX_LOAD) {         \
+        prefix##__grow(m);                                                              \
+    }                                                                                   \
+    prefix##_entry e;                                                                   \
+    e.key = k;                                                                          \
+    e.val = v;                                                                          \
+    prefix##__place(m, e, hash);                                                        \
+    return 0;                                                                           \
+}                                                                                       \
+                                                                                        \
+/* Returns 0 if the key was deleted or 1 if it wasn't found. If old is not */           \
+/* NULL, the deleted entry is copied there (so you can free it) */                      \
+static inline int prefix##_delete(prefix##_map *m, ktype k, prefix##_entry *old) {      \
+    long found = prefix##__find(m, k, (uint32_t) (hash_expr(k)));                       \
+    if (found < 0) return 1;                                                            \
+    uint32_t i = found;                                                                 \
+    if (old) *old = m->slots[i];                                                        \
+                                                                                        \
+    uint32_t mask = m->capacity - 1;                                                    \
+    uint32_t next = (i + 1) & mask;                                                     \
+    while (m->meta[next].dist > 1) {                                                    \
+        m->meta[i].hash = m->meta[next].hash;                                           \
+        m->meta[i].dist = m->meta[next].dist - 1;                                       \
+        m->slots[i] = m->slots[next];                                                   \
+        i = next;                                                                       \
+        next = (next + 1) & mask;                                                       \
+    }                                                                                   \
+    m->meta[i].dist = 0;                                                                \
+    m->size--;                                                                          \
+    return 0;                                                                           \
+}                                                                                       \
+                                                                                        \
+/* Iterators are slot indices, same as rh_map */                                        \
+static inline unsigned long prefix##_next(prefix##_map const *m, unsigned long it) {    \
+    unsigned long i;                                                                    \
+    for (i = it + 1; i < m->capacity; i++) {                                            \
+        if (m->meta[i].dist) return i;                                                  \
+    }                                                                                   \
+    return m->capacity;                                                                 \
+}                                                                                       \
+                                                                                        \
+static inline unsigned long prefix##_begin(prefix##_map const *m) {                     \
+    return prefix##_next(m, (unsigned long) -1);                                        \
+}                                                                                       \
+                                                                                        \
+static inline unsigned long prefix##_end(prefix##_map const *m) {                       \
+    return m->capacity;                                                                 \
+}                                                                                       \
+                                                                                        \
+static inline prefix##_entry *prefix##_at(prefix##_map const *m, unsigned long it) {    \
+    return &m->slots[it];                                                               \
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H 1
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "list.h" //For container_of
+
+//Companion to list.h for handing things between threads. This is Dmitry
+//Vyukov's intrusive multi-producer single-consumer queue:
+//  https://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+//Just like with list_head, you put an mpsc_node inside your own struct and
+//use container_of to get back to it.
+//
+//Any number of threads can call mpsc_push at the same time, and it never
+//waits for anyone (one atomic exchange and one store). Only ONE thread is
+//allowed to call mpsc_pop/mpsc_pop_n; typically this is the event loop that
+//owns the queue.
+//
+//Example:
+//
+//  struct job {
+//      int fd;
+//      mpsc_node node;
+//  };
+//
+//  //Any thread
+//  mpsc_push(&q, &my_job->node);
+//
+//  //Event loop thread
+//  mpsc_node *batch[64];
+//  unsigned n = mpsc_pop_n(&q, batch, 64);
+//  unsigned i;
+//  for (i = 0; i < n; i++) {
+//      struct job *j = container_of(batch[i], struct job, node);
+//      //...
+//  }
+
+typedef struct mpsc_node {
+    struct mpsc_node *_Atomic next;
+} mpsc_node;
+
+typedef struct {
+    //Producers only ever touch head, and the consumer mostly only touches
+    //tail. Keep them on different cache lines so producers don't keep
+    //stealing the consumer's line.
+    mpsc_node *_Atomic head;
+    char pad[64 - sizeof(mpsc_node*)];
+    mpsc_node *tail;
+    mpsc_node stub;
+} mpsc_queue;
+
+//Not thread-safe (obviously)
+static inline void mpsc_init(mpsc_queue *q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+//Safe to call from any thread
+static inline void mpsc_push(mpsc_queue *q, mpsc_node *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_node *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    //Between the exchange and this store, the queue is "broken": the
+    //consumer can't see node or anything pushed after it. mpsc_pop
+    //just reports an empty queue in that (very short) window.
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+//Consumer thread only. Returns NULL if there is nothing to pop right now.
+static inline mpsc_node *mpsc_pop(mpsc_queue *q) {
+    mpsc_node *tail = q->tail;
+    mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    //Skip over the stub
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    //tail is the last node we can see. If it isn't the head, a producer
+    //is halfway through a push and we have to wait for it.
+    mpsc_node *head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail != head) return NULL;
+
+    //We can't hand out the last node (we need something to stay in the
+    //queue) so put the stub back in behind it
+    mpsc_push(q, &q->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+//Consumer thread only. Pops up to max nodes into out (in FIFO order) and
+//returns how many were popped.
+static inline unsigned mpsc_pop_n(mpsc_queue *q, mpsc_node **out, unsigned max) {
+    unsigned n = 0;
+    while (n < max) {
+        mpsc_node *node = mpsc_pop(q);
+        if (!node) break;
+        out[n++] = node;
+    }
+    return n;
+}
+
+//Consumer thread only. Not exact if producers are pushing concurrently.
+static inline int mpsc_empty(mpsc_queue *q) {
+    mpsc_node *tail = q->tail;
+    return tail == &q->stub &&
+        atomic_load_explicit(&tail->next, memory_order_acquire) == NULL;
+}
+
+#endif
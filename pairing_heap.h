@@ -0,0 +1,243 @@
+#ifdef MM_IMPLEMENT
+	#ifndef PAIRING_HEAP_H_IMPLEMENTED
+		#define PAIRING_HEAP_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef PAIRING_HEAP_H
+		#define PAIRING_HEAP_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "pairing_heap.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stddef.h>
+#include "list.h" //For container_of
+#include "fast_fail.h"
+
+//An intrusive min-heap. Where heap.h memcpys elements around inside an array,
+//this one never moves anything: you put a pheap_node inside your own struct
+//(exactly like a list_head) and get your struct back with container_of.
+//Insert, meld and decrease-key are O(1); pop is O(log n) amortized.
+//
+//Example:
+//
+//  struct task {
+//      int deadline;
+//      pheap_node node;
+//  };
+//
+//  int task_cmp(pheap_node const *a, pheap_node const *b) {
+//      struct task const *x = container_of(a, struct task, node);
+//      struct task const *y = container_of(b, struct task, node);
+//      return x->deadline - y->deadline;
+//  }
+//
+//  pheap h;
+//  pheap_init(&h, task_cmp);
+//  pheap_insert(&h, &my_task->node);
+//  ...
+//  struct task *next = container_of(pheap_pop(&h), struct task, node);
+
+#ifndef MM_IMPLEMENT
+//The tree is stored in the usual "leftmost child, right sibling" way. For a
+//leftmost child, prev points at the parent; for everyone else it points at
+//the sibling on the left. This is what makes decrease-key O(1), since we can
+//unlink a node without searching for it.
+typedef struct pheap_node {
+	struct pheap_node *child;
+	struct pheap_node *next;
+	struct pheap_node *prev;
+} pheap_node;
+
+//Same convention as everywhere else: negative means a goes before b
+typedef int pheap_cmp_fn(pheap_node const *a, pheap_node const *b);
+
+typedef struct {
+	pheap_node *root;
+	pheap_cmp_fn *cmp;
+} pheap;
+
+#define PHEAP_INIT(cmp_fn) {NULL, cmp_fn}
+
+static inline void pheap_init(pheap *h, pheap_cmp_fn *cmp) {
+	h->root = NULL;
+	h->cmp = cmp;
+}
+
+#define pheap_empty(h) ((h)->root == NULL)
+
+//Returns the smallest node without removing it, or NULL if empty
+#define pheap_peek(h) ((h)->root)
+#endif
+
+#ifdef MM_IMPLEMENT
+//Links two roots together and returns the new root. The loser becomes the
+//leftmost child of the winner. Does not care what a->next and b->next were;
+//the returned root has next and prev cleared.
+static pheap_node *pheap_link(pheap_node *a, pheap_node *b, pheap_cmp_fn *cmp) {
+	if (cmp(b, a) < 0) {
+		pheap_node *tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	b->next = a->child;
+	if (a->child) a->child->prev = b;
+	b->prev = a;
+	a->child = b;
+
+	a->next = NULL;
+	a->prev = NULL;
+	return a;
+}
+
+//The famous two-pass pairing. First pass goes left to right linking nodes
+//in pairs; the second pass goes right to left linking each pair into the
+//result. Written iteratively (the recursive version blows the stack when
+//someone does a million inserts then a pop). The pairs from the first pass
+//are kept on a stack threaded through the next pointers, which conveniently
+//gives us the right-to-left order for free.
+static pheap_node *pheap_merge_pairs(pheap_node *first, pheap_cmp_fn *cmp) {
+	if (!first) return NULL;
+
+	pheap_node *pairs = NULL;
+	while (first) {
+		pheap_node *a = first;
+		pheap_node *b = a->next;
+		if (!b) {
+			a->next = pairs;
+			pairs = a;
+			break;
+		}
+		first = b->next;
+
+		pheap_node *m = pheap_link(a, b, cmp);
+		m->next = pairs;
+		pairs = m;
+	}
+
+	pheap_node *res = pairs;
+	pairs = pairs->next;
+	while (pairs) {
+		pheap_node *nxt = pairs->next;
+		res = pheap_link(res, pairs, cmp);
+		pairs = nxt;
+	}
+
+	res->next = NULL;
+	res->prev = NULL;
+	return res;
+}
+
+//Unlinks a (non-root) node, along with its whole subtree, from its parent
+static void pheap_cut(pheap_node *node) {
+	if (node->prev->child == node) {
+		node->prev->child = node->next;
+	} else {
+		node->prev->next = node->next;
+	}
+	if (node->next) node->next->prev = node->prev;
+
+	node->next = NULL;
+	node->prev = NULL;
+}
+#endif
+
+void pheap_insert(pheap *h, pheap_node *node)
+#ifdef MM_IMPLEMENT
+{
+	node->child = NULL;
+	node->next = NULL;
+	node->prev = NULL;
+
+	if (!h->root) {
+		h->root = node;
+	} else {
+		h->root = pheap_link(h->root, node, h->cmp);
+	}
+}
+#else
+;
+#endif
+
+//Moves everything in other into h. Both heaps must use the same comparison
+//function. other is left empty.
+void pheap_meld(pheap *h, pheap *other)
+#ifdef MM_IMPLEMENT
+{
+	if (!other->root) return;
+
+	if (!h->root) {
+		h->root = other->root;
+	} else {
+		h->root = pheap_link(h->root, other->root, h->cmp);
+	}
+	other->root = NULL;
+}
+#else
+;
+#endif
+
+//Removes and returns the smallest node, or NULL if the heap is empty
+pheap_node *pheap_pop(pheap *h)
+#ifdef MM_IMPLEMENT
+{
+	pheap_node *ret = h->root;
+	if (!ret) return NULL;
+
+	h->root = pheap_merge_pairs(ret->child, h->cmp);
+	ret->child = NULL;
+	return ret;
+}
+#else
+;
+#endif
+
+//Call this AFTER you have made node's key smaller. (Making it bigger is not
+//supported; remove it and insert it again instead).
+void pheap_decrease_key(pheap *h, pheap_node *node)
+#ifdef MM_IMPLEMENT
+{
+	if (node == h->root) return; //Still the smallest
+
+	pheap_cut(node);
+	h->root = pheap_link(h->root, node, h->cmp);
+}
+#else
+;
+#endif
+
+//Removes an arbitrary node from the heap
+void pheap_remove(pheap *h, pheap_node *node)
+#ifdef MM_IMPLEMENT
+{
+	if (node == h->root) {
+		pheap_pop(h);
+		return;
+	}
+
+	pheap_cut(node);
+	pheap_node *sub = pheap_merge_pairs(node->child, h->cmp);
+	node->child = NULL;
+	if (sub) h->root = pheap_link(h->root, sub, h->cmp);
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
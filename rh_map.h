@@ -0,0 +1,425 @@
+#ifdef MM_IMPLEMENT
+	#ifndef RH_MAP_H_IMPLEMENTED
+		#define RH_MAP_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef RH_MAP_H
+		#define RH_MAP_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "rh_map.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "map.h" //For the hash/comp/free functions and the VAL2VAL etc. helpers
+#include "fast_fail.h"
+
+//Yet another map, this time using Robin Hood hashing. It's plain linear
+//probing with one rule: when inserting, if the entry we're carrying is
+//further from its home slot than the one sitting in the current slot, they
+//swap places and we carry on with the other one. This evens out the probe
+//lengths, so they stay short even at 90% load. And since everything in a
+//run is sorted by distance from home, a lookup can give up as soon as it
+//sees an entry closer to home than it is.
+//
+//Deleting does a "backward shift": everything after the hole (up to the
+//next empty slot or the next entry that's already at home) slides back by
+//one. That means no tombstones, ever, which is the same reason map.h does
+//its relocation dance in map_search_delete.
+//
+//Each slot has a little metadata record with the cached hash and the
+//distance from home. Lookups mostly just scan those (eight per cache line)
+//and only touch a key when the hashes match.
+//
+//Usage is the same as map.h:
+//
+//  rh_map m;
+//  rh_map_init(&m, int, char const*, VAL2STR);
+//  rh_map_insert(&m, RV_AMP(5), 0, "five", 0);
+//  char const **s = rh_map_search(&m, RV_AMP(5));
+//
+//  unsigned long it;
+//  for (it = rh_map_begin(&m); it != rh_map_end(&m); rh_map_iter_step(&m, it)) {
+//      int k;
+//      char const *v;
+//      rh_map_iter_deref(&m, it, &k, &v);
+//  }
+//
+//  rh_map_free(&m);
+//
+//As with swiss_map, iterators are slot indices. Pointers returned by
+//rh_map_search are only good until the next insert or delete, since both
+//of them move entries around.
+
+#ifndef MM_IMPLEMENT
+//Must be a power of two
+#define RH_INIT_SZ 8
+
+//Max load factor, as a fraction out of 10
+#define RH_MAX_LOAD 9
+
+#define RH_STRUCT(ktype, vtype) \
+struct {                        \
+    __entry_flags flags;        \
+    ktype key;                  \
+    vtype val;                  \
+}
+
+typedef struct {
+    uint32_t hash;
+    uint32_t dist; //Distance from home slot, plus one. 0 means empty
+} rh_meta;
+
+typedef struct {
+    rh_meta *meta;
+    //One allocation holding capacity slots, plus two spares at the end
+    //that insert uses as scratch space when swapping entries
+    void *slots;
+    uint32_t capacity; //Always a power of two
+    unsigned cap_bits;
+    uint32_t size;
+
+    map_hash_fn *hash;
+    map_comp_fn *key_comp;
+    map_comp_fn *val_comp;
+    void (*key_free)(void *);
+    void (*val_free)(void *);
+
+    //Same trick as in map.h (see the big comment in the map struct)
+    int key_is_ptr;
+    int val_is_ptr;
+
+    unsigned slot_sz;
+    unsigned flag_off;
+    unsigned key_off;
+    unsigned key_sz;
+    unsigned val_off;
+    unsigned val_sz;
+} rh_map;
+
+#define rh_map_init(m,ktype,vtype,x) EXPAND(DEFER(rh_map_custom_init)(m,ktype,vtype,x))
+
+//entries is never used for anything except sizeof and offsets. It's called
+//entries so that the VAL2VAL etc. helpers from map.h work here too.
+#define rh_map_custom_init(m,ktype,vtype,hsh,kcmp,vcmp,kfree,vfree,ksz,vsz) \
+do {                                                                        \
+    RH_STRUCT(ktype,vtype) entries[1];                                      \
+                                                                            \
+    *(m) = (rh_map) {                                                       \
+        .hash = hsh,                                                        \
+        .key_comp = kcmp,                                                   \
+        .val_comp = vcmp,                                                   \
+        .key_free = kfree,                                                  \
+        .val_free = vfree,                                                  \
+                                                                            \
+        .key_is_ptr = (kcmp==map_ptr_comp||kcmp==map_str_comp),             \
+        .val_is_ptr = (vcmp==map_ptr_comp||vcmp==map_str_comp),             \
+                                                                            \
+        .slot_sz = sizeof(*entries),                                        \
+        .flag_off = anon_offsetof(entries,flags),                           \
+        .key_off = anon_offsetof(entries,key),                              \
+        .key_sz = ksz,                                                      \
+        .val_off = anon_offsetof(entries,val),                              \
+        .val_sz = vsz,                                                      \
+    };                                                                      \
+                                                                            \
+    __rh_map_alloc(m, RH_INIT_SZ);                                          \
+} while(0)
+
+#define rh_map_size(m) ((m)->size)
+
+//Iterators are slot indices. rh_map_end is one past the last slot.
+#define rh_map_begin(m) rh_map_next(m, (unsigned long) -1)
+#define rh_map_end(m) ((unsigned long) (m)->capacity)
+#define rh_map_iter_step(m, it) ((it) = rh_map_next(m, it))
+#define rh_map_iter_deref(m, it, k_dst, v_dst)                        \
+do {                                                                  \
+    void *slot = (m)->slots + (it)*(m)->slot_sz;                      \
+    void *pk = slot + (m)->key_off;                                   \
+    void *pv = slot + (m)->val_off;                                   \
+    memcpy(k_dst, pk, (m)->key_is_ptr ? sizeof(void*) : (m)->key_sz); \
+    memcpy(v_dst, pv, (m)->val_is_ptr ? sizeof(void*) : (m)->val_sz); \
+} while(0)
+#endif
+
+#ifdef MM_IMPLEMENT
+//Same Fibonacci hashing as map.h, so the top bits pick the home slot
+static inline uint32_t __rh_home(rh_map const *md, uint32_t hash) {
+    return (uint32_t) (hash * 2654435769u) >> (32 - md->cap_bits);
+}
+
+#define __rh_slot(md, i) ((md)->slots + (i)*(md)->slot_sz)
+
+//Returns the slot index holding pk, or -1 if it isn't there
+static long __rh_find(rh_map const *md, void const *pk, uint32_t hash) {
+    uint32_t mask = md->capacity - 1;
+    uint32_t i = __rh_home(md, hash);
+    uint32_t dist = 1;
+
+    //Once we hit a slot whose entry is closer to home than we are, our
+    //key can't be any further along (it would have taken this spot)
+    while (md->meta[i].dist >= dist) {
+        if (
+            md->meta[i].hash == hash &&
+            !md->key_comp(__rh_slot(md, i) + md->key_off, pk, md->key_sz)
+        ) {
+            return i;
+        }
+        i = (i + 1) & mask;
+        dist++;
+    }
+
+    return -1;
+}
+
+static void __rh_fill_slot(
+    void *slot,
+    rh_map const *md,
+    void const *pk, int free_key,
+    void const *pv, int free_val
+) {
+    __entry_flags *flags = slot + md->flag_off;
+    flags->is_filled = 1;
+    flags->free_key = free_key ? 1 : 0;
+    flags->free_val = free_val ? 1 : 0;
+    unsigned key_sz = (md->key_is_ptr) ? sizeof(void*) : md->key_sz;
+    unsigned val_sz = (md->val_is_ptr) ? sizeof(void*) : md->val_sz;
+    memcpy(slot + md->key_off, pk, key_sz);
+    memcpy(slot + md->val_off, pv, val_sz);
+}
+
+//Puts the entry in the carry slot (the first spare) into the table. The
+//key must not already be in the table and there must be room for it.
+static void __rh_place(rh_map *md, uint32_t hash) {
+    uint32_t mask = md->capacity - 1;
+    uint32_t i = __rh_home(md, hash);
+    uint32_t dist = 1;
+    void *carry = __rh_slot(md, md->capacity);
+    void *tmp = __rh_slot(md, md->capacity + 1);
+
+    while (md->meta[i].dist != 0) {
+        if (md->meta[i].dist < dist) {
+            //Take from the rich: the entry here is closer to home than
+            //we are, so it gets kicked out and we keep going with it
+            rh_meta m = md->meta[i];
+            md->meta[i].hash = hash;
+            md->meta[i].dist = dist;
+            hash = m.hash;
+            dist = m.dist;
+
+            memcpy(tmp, __rh_slot(md, i), md->slot_sz);
+            memcpy(__rh_slot(md, i), carry, md->slot_sz);
+            memcpy(carry, tmp, md->slot_sz);
+        }
+        i = (i + 1) & mask;
+        dist++;
+    }
+
+    md->meta[i].hash = hash;
+    md->meta[i].dist = dist;
+    memcpy(__rh_slot(md, i), carry, md->slot_sz);
+    md->size++;
+}
+#endif
+
+//Internal function that allocates an empty table with cap slots. Does not
+//free or move anything that was there before.
+void __rh_map_alloc(rh_map *md, uint32_t cap)
+#ifdef MM_IMPLEMENT
+{
+    md->meta = calloc(cap, sizeof(rh_meta));
+    md->slots = malloc((size_t) (cap + 2)*md->slot_sz);
+    if (!md->meta || !md->slots) FAST_FAIL("out of memory");
+    md->capacity = cap;
+    md->cap_bits = __builtin_ctz(cap);
+    md->size = 0;
+}
+#else
+;
+#endif
+
+#ifdef MM_IMPLEMENT
+static void __rh_grow(rh_map *md) {
+    rh_meta *old_meta = md->meta;
+    void *old_slots = md->slots;
+    uint32_t old_cap = md->capacity;
+
+    if (old_cap*2 < old_cap) FAST_FAIL("rh_map is too big");
+    __rh_map_alloc(md, old_cap*2);
+
+    //Thanks to the cached hashes, we don't need to call the hash function
+    //again. The keys and values move over as-is.
+    uint32_t i;
+    for (i = 0; i < old_cap; i++) {
+        if (old_meta[i].dist == 0) continue;
+        memcpy(__rh_slot(md, md->capacity), old_slots + i*md->slot_sz, md->slot_sz);
+        __rh_place(md, old_meta[i].hash);
+    }
+
+    free(old_meta);
+    free(old_slots);
+}
+
+//Removes the entry in slot i and slides the rest of its run back to fill
+//the hole
+static void __rh_erase(rh_map *md, uint32_t i) {
+    void *slot = __rh_slot(md, i);
+    __entry_flags *flags = slot + md->flag_off;
+    if (flags->free_key) md->key_free(slot + md->key_off);
+    if (flags->free_val) md->val_free(slot + md->val_off);
+
+    uint32_t mask = md->capacity - 1;
+    uint32_t next = (i + 1) & mask;
+    //Stop at an empty slot, or at an entry that's already home (dist 1)
+    while (md->meta[next].dist > 1) {
+        md->meta[i].hash = md->meta[next].hash;
+        md->meta[i].dist = md->meta[next].dist - 1;
+        memcpy(__rh_slot(md, i), __rh_slot(md, next), md->slot_sz);
+        i = next;
+        next = (next + 1) & mask;
+    }
+
+    md->meta[i].dist = 0;
+    md->size--;
+}
+#endif
+
+void rh_map_free(rh_map *md)
+#ifdef MM_IMPLEMENT
+{
+    uint32_t i;
+    for (i = 0; i < md->capacity; i++) {
+        if (md->meta[i].dist == 0) continue;
+        void *slot = __rh_slot(md, i);
+        __entry_flags *flags = slot + md->flag_off;
+        if (flags->free_key) md->key_free(slot + md->key_off);
+        if (flags->free_val) md->val_free(slot + md->val_off);
+    }
+
+    free(md->meta);
+    free(md->slots);
+    md->meta = NULL;
+    md->slots = NULL;
+    md->capacity = 0;
+    md->size = 0;
+}
+#else
+;
+#endif
+
+//Returns pointer to value in the map, or NULL if not found
+void *rh_map_search(rh_map const *md, void const *k)
+#ifdef MM_IMPLEMENT
+{
+    void const *pk = md->key_is_ptr ? &k : k;
+    long i = __rh_find(md, pk, md->hash(pk, md->key_sz));
+    return (i < 0) ? NULL : __rh_slot(md, i) + md->val_off;
+}
+#else
+;
+#endif
+
+//Returns 0 on success, 1 if previous value overwritten
+int rh_map_insert(
+    rh_map *md,
+    void const *k, int free_key,
+    void const *v, int free_val
+)
+#ifdef MM_IMPLEMENT
+{
+    void const *pk = md->key_is_ptr ? &k : k;
+    void const *pv = md->val_is_ptr ? &v : v;
+    uint32_t hash = md->hash(pk, md->key_sz);
+
+    long i = __rh_find(md, pk, hash);
+    if (i >= 0) {
+        void *slot = __rh_slot(md, i);
+        __entry_flags *flags = slot + md->flag_off;
+        if (flags->free_key) md->key_free(slot + md->key_off);
+        if (flags->free_val) md->val_free(slot + md->val_off);
+        __rh_fill_slot(slot, md, pk, free_key, pv, free_val);
+        return 1;
+    }
+
+    if ((uint64_t) (md->size + 1)*10 > (uint64_t) md->capacity*RH_MAX_LOAD) {
+        __rh_grow(md);
+    }
+
+    __rh_fill_slot(__rh_slot(md, md->capacity), md, pk, free_key, pv, free_val);
+    __rh_place(md, hash);
+
+    return 0;
+}
+#else
+;
+#endif
+
+//Same rules as map_search_delete: searches by k_needle if given (and then
+//also checks v_needle, if given), otherwise by v_needle. Returns 0 if an
+//entry was deleted or 1 if it wasn't found.
+int rh_map_search_delete(rh_map *md, void const *k_needle, void const *v_needle)
+#ifdef MM_IMPLEMENT
+{
+    void const *pv = md->val_is_ptr ? &v_needle : v_needle;
+    long i = -1;
+
+    if (k_needle) {
+        void const *pk = md->key_is_ptr ? &k_needle : k_needle;
+        i = __rh_find(md, pk, md->hash(pk, md->key_sz));
+        if (i < 0) return 1;
+
+        if (v_needle && md->val_comp(__rh_slot(md, i) + md->val_off, pv, md->val_sz) != 0) {
+            return 1;
+        }
+    } else {
+        //No choice but to look at everything
+        uint32_t j;
+        for (j = 0; j < md->capacity; j++) {
+            if (md->meta[j].dist == 0) continue;
+            if (md->val_comp(__rh_slot(md, j) + md->val_off, pv, md->val_sz) == 0) {
+                i = j;
+                break;
+            }
+        }
+        if (i < 0) return 1;
+    }
+
+    __rh_erase(md, i);
+    return 0;
+}
+#else
+;
+#endif
+
+//Returns the index of the next full slot after it, or rh_map_end(md)
+unsigned long rh_map_next(rh_map const *md, unsigned long it)
+#ifdef MM_IMPLEMENT
+{
+    unsigned long i;
+    for (i = it + 1; i < md->capacity; i++) {
+        if (md->meta[i].dist != 0) return i;
+    }
+    return md->capacity;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
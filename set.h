@@ -0,0 +1,163 @@
+#ifdef MM_IMPLEMENT
+	#ifndef SET_H_IMPLEMENTED
+		#define SET_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef SET_H
+		#define SET_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "set.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "list.h"
+#include "map.h"
+#include "fast_fail.h"
+
+//A hash set. This is literally a map.h map whose entries have no value
+//field, so it gets the same hashing, probing, resizing (incremental or
+//not) and iteration as map.h, without paying for a dummy value in every
+//entry.
+//
+//Keys follow the same rules as map.h: for a value-typed key, pass a
+//pointer to it; for a pointer or string key, pass the pointer itself.
+//
+//Example:
+//
+//  set visited;
+//  set_init(&visited, int, SET_VAL);
+//  set_insert(&visited, RV_AMP(node_id), 0);
+//  if (set_contains(&visited, RV_AMP(other_id))) ...
+//
+//  list_head *it;
+//  for (it = set_begin(&visited); it != set_end(&visited); set_iter_step(it)) {
+//      int id;
+//      set_iter_deref(&visited, it, &id);
+//  }
+//
+//  set_free(&visited);
+
+#ifndef MM_IMPLEMENT
+typedef map set;
+
+#define SET_STRUCT(ktype)        \
+struct {                         \
+    list_head entry_list;        \
+    __entry_flags flags;         \
+    uint32_t hash;               \
+    ktype key;                   \
+}
+
+//Same idea as VAL2VAL and friends
+#define SET_VAL map_val_wyhash,map_val_comp,map_val_free,sizeof(entries->key)
+#define SET_PTR map_ptr_wyhash,map_ptr_comp,map_ptr_free,sizeof(*entries->key)
+#define SET_STR map_str_wyhash,map_str_comp,map_str_free,0
+
+#define set_init(s,ktype,x) EXPAND(DEFER(set_custom_init)(s,ktype,x))
+
+//The "value" is zero bytes long and sits right at the end of the entry, so
+//all the memcpys of values in map.h just don't do anything
+#define set_custom_init(s,ktype,hsh,kcmp,kfree,ksz)                      \
+do {                                                                     \
+    SET_STRUCT(ktype) entries[1]; /* Only for sizeof and offsets */      \
+    __map_setup(                                                         \
+        s, sizeof(*entries),                                             \
+        anon_offsetof(entries,entry_list),                               \
+        anon_offsetof(entries,flags),                                    \
+        anon_offsetof(entries,hash),                                     \
+        anon_offsetof(entries,key), ksz,                                 \
+        sizeof(*entries), 0,                                             \
+        hsh, kcmp, map_val_comp, kfree, map_val_free                     \
+    );                                                                   \
+} while(0)
+
+//Returns 0 if k was added, or 1 if it was already there (in which case the
+//stored key is replaced by k, and the old one is freed if it was owned)
+#define set_insert(s, k, free_key) map_insert(s, k, free_key, "", 0)
+#define set_contains(s, k) (map_search(s, k) != NULL)
+//Returns 0 if k was removed, or 1 if it wasn't there
+#define set_remove(s, k) map_search_delete(s, k, NULL)
+#define set_free(s) map_free(s)
+
+#define set_begin(s) map_begin(s)
+#define set_end(s) map_end(s)
+#define set_iter_step(it) map_iter_step(it)
+#define set_iter_deref(s, it, k_dst)                                  \
+do {                                                                  \
+    void *pk = ((void*)it) - (s)->list_head_off + (s)->key_off;       \
+    memcpy(k_dst, pk, (s)->key_is_ptr ? sizeof(void*) : (s)->key_sz); \
+} while(0)
+#endif
+
+//Adds every key in src to dst. Both sets must have the same key type. The
+//keys are copied shallowly: for pointer and string sets, dst ends up
+//pointing at src's keys but doesn't own them. (src isn't const because 
+//iterating finishes any incremental resize it had going)
+void set_union(set *dst, set *src)
+#ifdef MM_IMPLEMENT
+{
+    if (dst == src) return;
+
+    list_head *cur;
+    for (cur = set_begin(src); cur != set_end(src); cur = cur->next) {
+        void *pk = ((void*)cur) - src->list_head_off + src->key_off;
+        void const *k = src->key_is_ptr ? *(void const **)pk : pk;
+        if (!set_contains(dst, k)) set_insert(dst, k, 0);
+    }
+}
+#else
+;
+#endif
+
+//Removes every key from dst that isn't also in src
+void set_intersect(set *dst, set const *src)
+#ifdef MM_IMPLEMENT
+{
+    if (dst == src) return;
+
+    //Walking the list and deleting as we go needs a little care.
+    //__map_remove_entry doesn't leave holes: if it removes an entry at
+    //its home slot, it pulls a later entry from the same bucket into that
+    //slot. So after a delete, either cur got refilled (and we have to look
+    //at it again) or cur itself was unlinked (and next is still valid).
+    __map_rehash_finish(dst);
+    list_head *head = map_end(dst);
+    list_head *cur = head->next;
+    while (cur != head) {
+        list_head *next = cur->next;
+        void *entry = ((void*)cur) - dst->list_head_off;
+        void *pk = entry + dst->key_off;
+        void const *k = dst->key_is_ptr ? *(void const **)pk : pk;
+
+        if (set_contains(src, k)) {
+            cur = next;
+            continue;
+        }
+
+        __map_remove_entry(dst, entry, 1);
+        __entry_flags *flags = entry + dst->flag_off;
+        if (!flags->is_filled) cur = next;
+    }
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
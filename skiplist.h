@@ -0,0 +1,360 @@
+#ifdef MM_IMPLEMENT
+	#ifndef SKIPLIST_H_IMPLEMENTED
+		#define SKIPLIST_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef SKIPLIST_H
+		#define SKIPLIST_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "skiplist.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "list.h" //For container_of
+#include "fast_fail.h"
+
+//An intrusive skip list, for when you want a sorted set and list_head's
+//O(n) sorted insert isn't good enough. Same idea as list_head: put a
+//skiplist_node in your struct and use container_of to get back to it.
+//Insert, remove and seek are O(log n) expected, and once you've found a
+//node, walking forwards in order is just following a pointer.
+//
+//The "towers" (the arrays of next pointers, one per level) are not inside
+//the node, since their size is random. They come out of a pool owned by the
+//skiplist, so inserting and removing doesn't touch malloc once the pool is
+//warmed up. Freeing the skiplist frees all the towers at once.
+//
+//Keys must be unique (it's a set).
+//
+//Example:
+//
+//  struct session {
+//      uint64_t expiry;
+//      skiplist_node node;
+//  };
+//
+//  int session_cmp(skiplist_node const *a, skiplist_node const *b) {
+//      uint64_t x = container_of(a, struct session, node)->expiry;
+//      uint64_t y = container_of(b, struct session, node)->expiry;
+//      return (x > y) - (x < y);
+//  }
+//
+//  int session_key_cmp(skiplist_node const *a, void const *key) {
+//      uint64_t x = container_of(a, struct session, node)->expiry;
+//      uint64_t y = *(uint64_t const *)key;
+//      return (x > y) - (x < y);
+//  }
+//
+//  //Visit all sessions expiring in [lo, hi)
+//  skiplist_node *n;
+//  for (
+//      n = skiplist_seek(&sl, &lo, session_key_cmp);
+//      n && session_key_cmp(n, &hi) < 0;
+//      n = skiplist_next(n)
+//  ) {
+//      //...
+//  }
+
+#ifndef MM_IMPLEMENT
+//With p = 1/4, 32 levels is good for way more nodes than you can fit in
+//memory
+#define SKIPLIST_MAX_LEVEL 32
+
+typedef struct skiplist_node {
+    struct skiplist_node **next; //next[0] is the plain sorted linked list
+    unsigned height;
+} skiplist_node;
+
+//Compares two nodes in the list. Negative means a goes before b.
+typedef int skiplist_cmp_fn(skiplist_node const *a, skiplist_node const *b);
+//Compares a node against a key (for seeking). Negative means the node goes
+//before the key.
+typedef int skiplist_key_cmp_fn(skiplist_node const *a, void const *key);
+
+typedef struct {
+    //The head doesn't need to be a real node; it's just a full-height
+    //tower with nothing attached.
+    skiplist_node *head[SKIPLIST_MAX_LEVEL];
+    unsigned level; //Number of levels currently in use
+    unsigned long len;
+    skiplist_cmp_fn *cmp;
+
+    //Random state for picking tower heights. Each list has its own, so
+    //there's no global state and no locking
+    uint64_t rng;
+
+    //Tower pool. Freed towers go onto free lists (one per height), and
+    //new ones get carved out of big chunks.
+    void *chunks;
+    char *bump;
+    size_t bump_left;
+    skiplist_node **free_towers[SKIPLIST_MAX_LEVEL + 1];
+} skiplist;
+
+#define skiplist_first(sl) ((sl)->head[0])
+#define skiplist_next(node) ((node)->next[0])
+#define skiplist_empty(sl) ((sl)->head[0] == NULL)
+#endif
+
+#ifdef MM_IMPLEMENT
+#define SKIPLIST_CHUNK_SZ 4096
+#endif
+
+void skiplist_init(skiplist *sl, skiplist_cmp_fn *cmp)
+#ifdef MM_IMPLEMENT
+{
+    int i;
+    for (i = 0; i < SKIPLIST_MAX_LEVEL; i++) sl->head[i] = NULL;
+    for (i = 0; i <= SKIPLIST_MAX_LEVEL; i++) sl->free_towers[i] = NULL;
+    sl->level = 1;
+    sl->len = 0;
+    sl->cmp = cmp;
+    //Any nonzero seed works. Seeding from the address means two lists
+    //don't end up with identical shapes.
+    sl->rng = 0x9E3779B97F4A7C15ull ^ (uintptr_t) sl;
+    sl->chunks = NULL;
+    sl->bump = NULL;
+    sl->bump_left = 0;
+}
+#else
+;
+#endif
+
+#ifdef MM_IMPLEMENT
+//xorshift64*
+static unsigned skiplist_random_height(skiplist *sl) {
+    uint64_t x = sl->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sl->rng = x;
+    x *= 0x2545F4914F6CDD1Dull;
+
+    //Each pair of bits is a coin flip that comes up heads 1/4 of the time
+    unsigned height = 1;
+    while ((x & 3) == 0 && height < SKIPLIST_MAX_LEVEL) {
+        height++;
+        x >>= 2;
+    }
+    return height;
+}
+
+static skiplist_node **skiplist_alloc_tower(skiplist *sl, unsigned height) {
+    skiplist_node **tower = sl->free_towers[height];
+    if (tower) {
+        //Free list is threaded through tower[0]
+        sl->free_towers[height] = (skiplist_node **) tower[0];
+        return tower;
+    }
+
+    size_t sz = height * sizeof(skiplist_node *);
+    if (sl->bump_left < sz) {
+        //Start a new chunk. The first pointer in the chunk links it to
+        //the previous one so we can free them all at the end.
+        void **chunk = malloc(SKIPLIST_CHUNK_SZ);
+        if (!chunk) FAST_FAIL("out of memory");
+        chunk[0] = sl->chunks;
+        sl->chunks = chunk;
+        sl->bump = (char *) (chunk + 1);
+        sl->bump_left = SKIPLIST_CHUNK_SZ - sizeof(void *);
+    }
+
+    tower = (skiplist_node **) sl->bump;
+    sl->bump += sz;
+    sl->bump_left -= sz;
+    return tower;
+}
+
+static void skiplist_free_tower(skiplist *sl, skiplist_node **tower, unsigned height) {
+    tower[0] = (skiplist_node *) sl->free_towers[height];
+    sl->free_towers[height] = tower;
+}
+
+//Fills preds[i] with the tower of the last node at level i that compares
+//less than node (or the head, if there isn't one)
+static void skiplist_find_preds(
+    skiplist *sl, skiplist_node const *node,
+    skiplist_node ***preds
+) {
+    skiplist_node **cur = sl->head;
+    int i;
+    for (i = sl->level - 1; i >= 0; i--) {
+        while (cur[i] && sl->cmp(cur[i], node) < 0) {
+            cur = cur[i]->next;
+        }
+        preds[i] = cur;
+    }
+}
+#endif
+
+//Returns NULL if node was inserted, or a pointer to the node that was
+//already in the list with the same key (in which case nothing changes).
+skiplist_node *skiplist_insert(skiplist *sl, skiplist_node *node)
+#ifdef MM_IMPLEMENT
+{
+    skiplist_node **preds[SKIPLIST_MAX_LEVEL];
+    skiplist_find_preds(sl, node, preds);
+
+    skiplist_node *existing = preds[0][0];
+    if (existing && sl->cmp(existing, node) == 0) return existing;
+
+    unsigned height = skiplist_random_height(sl);
+    while (sl->level < height) {
+        preds[sl->level] = sl->head;
+        sl->level++;
+    }
+
+    node->height = height;
+    node->next = skiplist_alloc_tower(sl, height);
+
+    unsigned i;
+    for (i = 0; i < height; i++) {
+        node->next[i] = preds[i][i];
+        preds[i][i] = node;
+    }
+
+    sl->len++;
+    return NULL;
+}
+#else
+;
+#endif
+
+//node must be in the list
+void skiplist_remove(skiplist *sl, skiplist_node *node)
+#ifdef MM_IMPLEMENT
+{
+    skiplist_node **preds[SKIPLIST_MAX_LEVEL];
+    skiplist_find_preds(sl, node, preds);
+
+    if (preds[0][0] != node) {
+        FAST_FAIL("Removing a node that isn't in the skiplist");
+    }
+
+    unsigned i;
+    for (i = 0; i < node->height; i++) {
+        preds[i][i] = node->next[i];
+    }
+
+    //Drop any levels that are now empty
+    while (sl->level > 1 && sl->head[sl->level - 1] == NULL) {
+        sl->level--;
+    }
+
+    skiplist_free_tower(sl, node->next, node->height);
+    node->next = NULL;
+    node->height = 0;
+    sl->len--;
+}
+#else
+;
+#endif
+
+//Returns the first node that compares greater than or equal to key, or NULL
+//if there isn't one
+skiplist_node *skiplist_seek(skiplist const *sl, void const *key, skiplist_key_cmp_fn *cmp)
+#ifdef MM_IMPLEMENT
+{
+    skiplist_node * const *cur = sl->head;
+    int i;
+    for (i = sl->level - 1; i >= 0; i--) {
+        while (cur[i] && cmp(cur[i], key) < 0) {
+            cur = cur[i]->next;
+        }
+    }
+    return cur[0];
+}
+#else
+;
+#endif
+
+//Returns the node that compares equal to key, or NULL if there isn't one
+skiplist_node *skiplist_find(skiplist const *sl, void const *key, skiplist_key_cmp_fn *cmp)
+#ifdef MM_IMPLEMENT
+{
+    skiplist_node *ret = skiplist_seek(sl, key, cmp);
+    if (ret && cmp(ret, key) == 0) return ret;
+    return NULL;
+}
+#else
+;
+#endif
+
+//Builds the list from n nodes that are already sorted (strictly increasing)
+//in O(n), without doing any searches. The list must be empty.
+void skiplist_build(skiplist *sl, skiplist_node **nodes, unsigned long n)
+#ifdef MM_IMPLEMENT
+{
+    if (!skiplist_empty(sl)) {
+        FAST_FAIL("skiplist_build needs an empty list");
+    }
+
+    //Since everything goes on the end, we only need to remember the last
+    //tower at each level
+    skiplist_node **last[SKIPLIST_MAX_LEVEL];
+    int i;
+    for (i = 0; i < SKIPLIST_MAX_LEVEL; i++) last[i] = sl->head;
+
+    unsigned long j;
+    for (j = 0; j < n; j++) {
+        skiplist_node *node = nodes[j];
+        if (j > 0 && sl->cmp(nodes[j-1], node) >= 0) {
+            FAST_FAIL("skiplist_build input is not sorted");
+        }
+
+        unsigned height = skiplist_random_height(sl);
+        if (height > sl->level) sl->level = height;
+
+        node->height = height;
+        node->next = skiplist_alloc_tower(sl, height);
+
+        unsigned h;
+        for (h = 0; h < height; h++) {
+            node->next[h] = NULL;
+            last[h][h] = node;
+            last[h] = node->next;
+        }
+    }
+
+    sl->len = n;
+}
+#else
+;
+#endif
+
+//Frees all the towers. The nodes themselves are yours, and they are no
+//longer usable as skiplist nodes after this.
+void skiplist_free(skiplist *sl)
+#ifdef MM_IMPLEMENT
+{
+    void **chunk = sl->chunks;
+    while (chunk) {
+        void **next = chunk[0];
+        free(chunk);
+        chunk = next;
+    }
+    skiplist_init(sl, sl->cmp);
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,475 @@
+#ifdef MM_IMPLEMENT
+	#ifndef SWISS_MAP_H_IMPLEMENTED
+		#define SWISS_MAP_H_IMPLEMENTED 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#else
+	#ifndef SWISS_MAP_H
+		#define SWISS_MAP_H 1
+		#define SHOULD_INCLUDE 1
+	#else
+		#define SHOULD_INCLUDE 0
+	#endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "swiss_map.h"
+#define MM_IMPLEMENT 1
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "map.h" //For the hash/comp/free functions and the VAL2VAL etc. helpers
+#include "fast_fail.h"
+
+//An open-addressing alternative to map.h, in the style of Google's "Swiss
+//tables" (abseil's flat_hash_map). map.h walks a chain of list_heads to
+//find a key, and every hop is a potential cache miss. This one keeps a
+//separate array of one-byte "control" tags, one per slot, holding 7 bits
+//of the key's hash. Slots are grouped 16 at a time, and one SSE2 compare
+//checks all 16 tags in a group at once. A lookup usually costs one cache
+//line of tags, plus one key compare in the slot array.
+//
+//It's used the same way as map.h, with the same helpers:
+//
+//  swiss_map m;
+//  swiss_map_init(&m, char const*, int, STR2VAL);
+//  swiss_map_insert(&m, strdup("hello"), 1, RV_AMP(5), 0);
+//  int *v = swiss_map_search(&m, "hello");
+//  swiss_map_search_delete(&m, "hello", NULL);
+//
+//  unsigned long it;
+//  for (it = swiss_map_begin(&m); it != swiss_map_end(&m); swiss_map_iter_step(&m, it)) {
+//      char const *k;
+//      int v;
+//      swiss_map_iter_deref(&m, it, &k, &v);
+//  }
+//
+//  swiss_map_free(&m);
+//
+//Differences from map.h: nothing in here is a list_head, so iterators are
+//plain slot indices, and pointers returned by swiss_map_search are only
+//good until the next insert (which can move everything around).
+
+#ifndef MM_IMPLEMENT
+//Control byte values. Anything with the top bit clear is a full slot, and
+//the low 7 bits are the bottom 7 bits of the key's hash.
+#define SWISS_EMPTY   ((uint8_t) 0x80)
+#define SWISS_DELETED ((uint8_t) 0xFE) //a.k.a. tombstone
+#define SWISS_GROUP_SZ 16
+
+//Must be a power of two and at least SWISS_GROUP_SZ
+#define SWISS_INIT_SZ 16
+
+#define SWISS_STRUCT(ktype, vtype) \
+struct {                           \
+    __entry_flags flags;           \
+    ktype key;                     \
+    vtype val;                     \
+}
+
+typedef struct {
+    //capacity control bytes, followed by capacity slots (both in the same
+    //allocation, so freeing ctrl frees everything)
+    uint8_t *ctrl;
+    void *slots;
+    uint32_t capacity; //Always a power of two
+    uint32_t size; //Number of full slots
+    //How many more EMPTY slots we can use up before resizing. Tombstones
+    //don't count as free, since reusing them is free of charge.
+    uint32_t growth_left;
+
+    map_hash_fn *hash;
+    map_comp_fn *key_comp;
+    map_comp_fn *val_comp;
+    void (*key_free)(void *);
+    void (*val_free)(void *);
+
+    //Same trick as in map.h (see the big comment in the map struct)
+    int key_is_ptr;
+    int val_is_ptr;
+
+    unsigned slot_sz;
+    unsigned flag_off;
+    unsigned key_off;
+    unsigned key_sz;
+    unsigned val_off;
+    unsigned val_sz;
+} swiss_map;
+
+#define swiss_map_init(m,ktype,vtype,x) EXPAND(DEFER(swiss_map_custom_init)(m,ktype,vtype,x))
+
+//entries is never used for anything except sizeof and offsets. It's called
+//entries so that the VAL2VAL etc. helpers from map.h work here too.
+#define swiss_map_custom_init(m,ktype,vtype,hsh,kcmp,vcmp,kfree,vfree,ksz,vsz) \
+do {                                                                           \
+    SWISS_STRUCT(ktype,vtype) entries[1];                                      \
+                                                                               \
+    *(m) = (swiss_map) {                                                       \
+        .hash = hsh,                                                           \
+        .key_comp = kcmp,                                                      \
+        .val_comp = vcmp,                                                      \
+        .key_free = kfree,                                                     \
+        .val_free = vfree,                                                     \
+                                                                               \
+        .key_is_ptr = (kcmp==map_ptr_comp||kcmp==map_str_comp),                \
+        .val_is_ptr = (vcmp==map_ptr_comp||vcmp==map_str_comp),                \
+                                                                               \
+        .slot_sz = sizeof(*entries),                                           \
+        .flag_off = anon_offsetof(entries,flags),                              \
+        .key_off = anon_offsetof(entries,key),                                 \
+        .key_sz = ksz,                                                         \
+        .val_off = anon_offsetof(entries,val),                                 \
+        .val_sz = vsz,                                                         \
+    };                                                                         \
+                                                                               \
+    __swiss_map_alloc(m, SWISS_INIT_SZ);                                       \
+} while(0)
+
+#define swiss_map_size(m) ((m)->size)
+
+//Iterators are slot indices. swiss_map_end is one past the last slot.
+#define swiss_map_begin(m) swiss_map_next(m, (unsigned long) -1)
+#define swiss_map_end(m) ((unsigned long) (m)->capacity)
+#define swiss_map_iter_step(m, it) ((it) = swiss_map_next(m, it))
+#define swiss_map_iter_deref(m, it, k_dst, v_dst)                     \
+do {                                                                  \
+    void *slot = (m)->slots + (it)*(m)->slot_sz;                      \
+    void *pk = slot + (m)->key_off;                                   \
+    void *pv = slot + (m)->val_off;                                   \
+    memcpy(k_dst, pk, (m)->key_is_ptr ? sizeof(void*) : (m)->key_sz); \
+    memcpy(v_dst, pv, (m)->val_is_ptr ? sizeof(void*) : (m)->val_sz); \
+} while(0)
+#endif
+
+#ifdef MM_IMPLEMENT
+//These three return a 16 bit mask with one bit per slot in the group
+//starting at g. With SSE2, each is a couple of instructions.
+#ifdef __SSE2__
+static inline uint32_t __swiss_match(uint8_t const *g, uint8_t tag) {
+    __m128i ctrl = _mm_loadu_si128((__m128i const *) g);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) tag)));
+}
+
+//EMPTY and DELETED are the only control bytes with the top bit set, and
+//movemask grabs exactly the top bits
+static inline uint32_t __swiss_match_free(uint8_t const *g) {
+    return _mm_movemask_epi8(_mm_loadu_si128((__m128i const *) g));
+}
+#else
+//Portable fallback. Slower, but the probing logic is the same.
+static inline uint32_t __swiss_match(uint8_t const *g, uint8_t tag) {
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < SWISS_GROUP_SZ; i++) {
+        if (g[i] == tag) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline uint32_t __swiss_match_free(uint8_t const *g) {
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < SWISS_GROUP_SZ; i++) {
+        if (g[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+}
+#endif
+
+static inline uint32_t __swiss_match_empty(uint8_t const *g) {
+    return __swiss_match(g, SWISS_EMPTY);
+}
+
+//Index of the lowest set bit in a nonzero mask
+static inline unsigned __swiss_first(uint32_t mask) {
+    return __builtin_ctz(mask);
+}
+
+//The bottom 7 bits of the hash go in the control byte, and the rest pick
+//the first group to look in
+#define __swiss_h1(hash) ((hash) >> 7)
+#define __swiss_h2(hash) ((uint8_t) ((hash) & 0x7F))
+
+//Max load factor is 7/8. There is always at least one EMPTY slot, which
+//is what guarantees that probing for a missing key stops.
+#define __swiss_max_load(cap) ((cap) - (cap)/8)
+
+//Groups are visited in "triangular" order: g, g+1, g+3, g+6, ... Since
+//the number of groups is a power of two, this hits every group exactly
+//once before repeating.
+#define __swiss_for_each_group(md, hash, g, i)                              \
+    for (                                                                  \
+        (i) = 0, (g) = __swiss_h1(hash) & ((md)->capacity/SWISS_GROUP_SZ - 1); \
+        ;                                                                  \
+        (i)++, (g) = ((g) + (i)) & ((md)->capacity/SWISS_GROUP_SZ - 1)     \
+    )
+
+static void *__swiss_find(swiss_map const *md, void const *pk, uint32_t hash) {
+    uint8_t tag = __swiss_h2(hash);
+    uint32_t g, i;
+    __swiss_for_each_group(md, hash, g, i) {
+        uint8_t const *grp = md->ctrl + g*SWISS_GROUP_SZ;
+        uint32_t mask = __swiss_match(grp, tag);
+        while (mask) {
+            unsigned idx = g*SWISS_GROUP_SZ + __swiss_first(mask);
+            void *slot = md->slots + idx*md->slot_sz;
+            if (!md->key_comp(slot + md->key_off, pk, md->key_sz)) {
+                return slot;
+            }
+            mask &= mask - 1;
+        }
+
+        //If this group had an empty slot, then the key would have been
+        //put there (or somewhere before it) if it was in the table
+        if (__swiss_match_empty(grp)) return NULL;
+    }
+}
+
+//Returns the index of the first EMPTY or DELETED slot in hash's probe
+//sequence
+static uint32_t __swiss_find_free(swiss_map const *md, uint32_t hash) {
+    uint32_t g, i;
+    __swiss_for_each_group(md, hash, g, i) {
+        uint32_t mask = __swiss_match_free(md->ctrl + g*SWISS_GROUP_SZ);
+        if (mask) return g*SWISS_GROUP_SZ + __swiss_first(mask);
+    }
+}
+
+static void __swiss_fill_slot(
+    void *slot,
+    swiss_map const *md,
+    void const *pk, int free_key,
+    void const *pv, int free_val
+) {
+    __entry_flags *flags = slot + md->flag_off;
+    flags->is_filled = 1;
+    flags->free_key = free_key ? 1 : 0;
+    flags->free_val = free_val ? 1 : 0;
+    unsigned key_sz = (md->key_is_ptr) ? sizeof(void*) : md->key_sz;
+    unsigned val_sz = (md->val_is_ptr) ? sizeof(void*) : md->val_sz;
+    memcpy(slot + md->key_off, pk, key_sz);
+    memcpy(slot + md->val_off, pv, val_sz);
+}
+#endif
+
+//Internal function that (re)allocates the table with cap slots. Does not
+//free or move anything that was there before.
+void __swiss_map_alloc(swiss_map *md, uint32_t cap)
+#ifdef MM_IMPLEMENT
+{
+    //cap is a multiple of 16, so the slots start nicely aligned
+    md->ctrl = malloc(cap + (size_t) cap*md->slot_sz);
+    if (!md->ctrl) FAST_FAIL("out of memory");
+    memset(md->ctrl, SWISS_EMPTY, cap);
+    md->slots = md->ctrl + cap;
+    md->capacity = cap;
+    md->size = 0;
+    md->growth_left = __swiss_max_load(cap);
+}
+#else
+;
+#endif
+
+#ifdef MM_IMPLEMENT
+//Called when we run out of EMPTY slots. If the table is actually pretty
+//empty, it's full of tombstones; rebuilding at the same size gets rid of
+//them. Otherwise, double the size.
+static void __swiss_rehash(swiss_map *md) {
+    uint8_t *old_ctrl = md->ctrl;
+    void *old_slots = md->slots;
+    uint32_t old_cap = md->capacity;
+
+    uint32_t new_cap = old_cap;
+    if (md->size >= __swiss_max_load(old_cap)/2) new_cap *= 2;
+    if (new_cap < old_cap) FAST_FAIL("swiss_map is too big");
+
+    __swiss_map_alloc(md, new_cap);
+
+    uint32_t i;
+    for (i = 0; i < old_cap; i++) {
+        if (old_ctrl[i] & 0x80) continue;
+
+        //No need to check for duplicates, and the keys and values move
+        //over as-is (including who owns them)
+        void *old_slot = old_slots + i*md->slot_sz;
+        uint32_t hash = md->hash(old_slot + md->key_off, md->key_sz);
+        uint32_t idx = __swiss_find_free(md, hash);
+        md->ctrl[idx] = __swiss_h2(hash);
+        memcpy(md->slots + idx*md->slot_sz, old_slot, md->slot_sz);
+        md->size++;
+        md->growth_left--;
+    }
+
+    free(old_ctrl);
+}
+
+static void __swiss_erase(swiss_map *md, void *slot) {
+    __entry_flags *flags = slot + md->flag_off;
+    if (flags->free_key) md->key_free(slot + md->key_off);
+    if (flags->free_val) md->val_free(slot + md->val_off);
+    flags->is_filled = 0;
+
+    uint32_t idx = (slot - md->slots) / md->slot_sz;
+    uint8_t const *grp = md->ctrl + (idx & ~(SWISS_GROUP_SZ - 1));
+
+    //A probe only ever moves past a group if the group had no EMPTY
+    //slots. So if this group still has one, nobody's probe sequence goes
+    //through this slot and we can mark it EMPTY instead of leaving a
+    //tombstone.
+    if (__swiss_match_empty(grp)) {
+        md->ctrl[idx] = SWISS_EMPTY;
+        md->growth_left++;
+    } else {
+        md->ctrl[idx] = SWISS_DELETED;
+    }
+    md->size--;
+}
+#endif
+
+void swiss_map_free(swiss_map *md)
+#ifdef MM_IMPLEMENT
+{
+    uint32_t i;
+    for (i = 0; i < md->capacity; i++) {
+        if (md->ctrl[i] & 0x80) continue;
+        void *slot = md->slots + i*md->slot_sz;
+        __entry_flags *flags = slot + md->flag_off;
+        if (flags->free_key) md->key_free(slot + md->key_off);
+        if (flags->free_val) md->val_free(slot + md->val_off);
+    }
+
+    free(md->ctrl);
+    md->ctrl = NULL;
+    md->slots = NULL;
+    md->capacity = 0;
+    md->size = 0;
+    md->growth_left = 0;
+}
+#else
+;
+#endif
+
+//Returns pointer to value in the map, or NULL if not found
+void *swiss_map_search(swiss_map const *md, void const *k)
+#ifdef MM_IMPLEMENT
+{
+    void const *pk = md->key_is_ptr ? &k : k;
+    void *slot = __swiss_find(md, pk, md->hash(pk, md->key_sz));
+    return slot ? slot + md->val_off : NULL;
+}
+#else
+;
+#endif
+
+//Returns 0 on success, 1 if previous value overwritten
+int swiss_map_insert(
+    swiss_map *md,
+    void const *k, int free_key,
+    void const *v, int free_val
+)
+#ifdef MM_IMPLEMENT
+{
+    void const *pk = md->key_is_ptr ? &k : k;
+    void const *pv = md->val_is_ptr ? &v : v;
+    uint32_t hash = md->hash(pk, md->key_sz);
+
+    void *slot = __swiss_find(md, pk, hash);
+    if (slot) {
+        __entry_flags *flags = slot + md->flag_off;
+        if (flags->free_key) md->key_free(slot + md->key_off);
+        if (flags->free_val) md->val_free(slot + md->val_off);
+        __swiss_fill_slot(slot, md, pk, free_key, pv, free_val);
+        return 1;
+    }
+
+    uint32_t idx = __swiss_find_free(md, hash);
+    //Reusing a tombstone is always fine, but using up an EMPTY slot might
+    //take us past the max load
+    if (md->ctrl[idx] == SWISS_EMPTY && md->growth_left == 0) {
+        __swiss_rehash(md);
+        idx = __swiss_find_free(md, hash);
+    }
+
+    if (md->ctrl[idx] == SWISS_EMPTY) md->growth_left--;
+    md->ctrl[idx] = __swiss_h2(hash);
+    __swiss_fill_slot(md->slots + idx*md->slot_sz, md, pk, free_key, pv, free_val);
+    md->size++;
+
+    return 0;
+}
+#else
+;
+#endif
+
+//Same rules as map_search_delete: searches by k_needle if given (and then
+//also checks v_needle, if given), otherwise by v_needle. Returns 0 if an
+//entry was deleted or 1 if it wasn't found.
+int swiss_map_search_delete(swiss_map *md, void const *k_needle, void const *v_needle)
+#ifdef MM_IMPLEMENT
+{
+    void const *pv = md->val_is_ptr ? &v_needle : v_needle;
+    void *slot = NULL;
+
+    if (k_needle) {
+        void const *pk = md->key_is_ptr ? &k_needle : k_needle;
+        slot = __swiss_find(md, pk, md->hash(pk, md->key_sz));
+        if (!slot) return 1;
+
+        if (v_needle && md->val_comp(slot + md->val_off, pv, md->val_sz) != 0) {
+            return 1;
+        }
+    } else {
+        //No choice but to look at everything
+        uint32_t i;
+        for (i = 0; i < md->capacity; i++) {
+            if (md->ctrl[i] & 0x80) continue;
+            void *cur = md->slots + i*md->slot_sz;
+            if (md->val_comp(cur + md->val_off, pv, md->val_sz) == 0) {
+                slot = cur;
+                break;
+            }
+        }
+        if (!slot) return 1;
+    }
+
+    __swiss_erase(md, slot);
+    return 0;
+}
+#else
+;
+#endif
+
+//Returns the index of the next full slot after it, or swiss_map_end(md).
+//Skips a whole group of empty slots at a time.
+unsigned long swiss_map_next(swiss_map const *md, unsigned long it)
+#ifdef MM_IMPLEMENT
+{
+    unsigned long i = it + 1;
+    while (i < md->capacity) {
+        unsigned long g = i & ~(unsigned long) (SWISS_GROUP_SZ - 1);
+        uint32_t full = ~__swiss_match_free(md->ctrl + g) & 0xFFFF;
+        //Ignore the slots in this group that come before i
+        full &= ~0u << (i - g);
+        if (full) return g + __swiss_first(full);
+        i = g + SWISS_GROUP_SZ;
+    }
+    return md->capacity;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif